@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# check_large.sh: stress test of a database larger than 4 GiB
+#
+# Grows a new database past 4 GiB with a sparse truncate, inserts an
+# image whose extents all land past the 4 GiB offset, reads it back in
+# every resolution and compacts the database in place.
+#
+# usage: check_large.sh [image.jpg]
+#        without an image, a test image is made with the vips tool
+#
+# Basile Thullen, Jeremy Hottinger, 2016
+
+PICTDBM="$(cd "$(dirname "$0")" && pwd)/pictDBM"
+LIMIT=4294967296
+SPARSE_SIZE=5G
+
+fail()
+{
+    echo "check_large: $*" >&2
+    exit 1
+}
+
+WORKDIR=$(mktemp -d) || fail "cannot create a temporary directory"
+trap 'rm -rf "$WORKDIR"' EXIT
+
+if [ $# -ge 1 ]; then
+    cp "$1" "$WORKDIR/image.jpg" || fail "cannot read $1"
+else
+    vips black "$WORKDIR/image.jpg" 640 480 --bands 3 \
+        || fail "no image given and the vips tool could not make one"
+fi
+
+cd "$WORKDIR" || fail "cannot enter $WORKDIR"
+
+# offset of a resolution of an image, from the listing of the database
+offset()
+{
+    "$PICTDBM" list large.pictdb | awk -v id="$1" -v res="$2" '
+        $1 == "PICTURE" { current = $3 }
+        current == id && $1 == "OFFSET" && index($2, res) == 1 {
+            sub(/^[^:]*: */, "")
+            print $1
+        }'
+}
+
+"$PICTDBM" create large.pictdb -max_files 10 > /dev/null || fail "create failed"
+truncate -s "$SPARSE_SIZE" large.pictdb || fail "cannot grow the database"
+
+"$PICTDBM" insert large.pictdb big image.jpg || fail "insert past 4 GiB failed"
+"$PICTDBM" read large.pictdb big thumb || fail "thumbnail read failed"
+"$PICTDBM" read large.pictdb big small || fail "small read failed"
+"$PICTDBM" read large.pictdb big orig || fail "original read failed"
+cmp -s big_orig.jpg image.jpg || fail "original read back differs"
+
+for res in ORIG THUMB SMALL; do
+    at=$(offset big "$res")
+    [ -n "$at" ] && [ "$at" -gt "$LIMIT" ] || fail "$res stored at ${at:-?}, not past 4 GiB"
+done
+
+mkdir before && mv big_*.jpg before/ || fail "cannot keep the images read"
+
+"$PICTDBM" gc large.pictdb || fail "gc failed"
+
+size=$(wc -c < large.pictdb)
+[ "$size" -lt "$LIMIT" ] || fail "gc left $size bytes"
+
+for res in orig thumb small; do
+    "$PICTDBM" read large.pictdb big "$res" || fail "$res read after gc failed"
+    cmp -s "big_$res.jpg" "before/big_$res.jpg" || fail "$res differs after gc"
+done
+
+echo "check_large: ok"
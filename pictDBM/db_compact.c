@@ -0,0 +1,461 @@
+/**
+ * @file db_compact.c
+ * @brief pictDB library: in-place compaction
+ *
+ * Every extent is first copied, the copy is made durable, and only then
+ * are the metadata repointed to it, so an interruption at any point leaves
+ * a valid database. The copies are made without the lock of the database,
+ * into bytes no image uses: the write lock is only taken to repoint the
+ * metadata, and the batch is given up if the database changed meanwhile.
+ *
+ * A batch of extents is moved directly when all its destinations lie
+ * below its first source. Otherwise the batch would overwrite itself: it
+ * is bounced through a region of at most COMPACT_BOUNCE_BYTES appended to
+ * the file first. Once the batch reached its place, the region is
+ * truncated away when it is still the end of the file, and the next step
+ * reuses the same bytes. Images appended or resized while the copies ran
+ * land after the region instead: it is then punched and counted as dead
+ * bytes, and the next step bounces past the new end of the file, so the
+ * file may grow by one region per such step until the next gc.
+ *
+ * @author Basile Thullen, Jeremy Hottinger
+ * @date 8 Jun 2016
+ */
+
+#include "db_compact.h"
+#include "db_index.h"
+
+#include <sys/stat.h>   // for fstat
+#include <unistd.h>     // for ftruncate
+
+// maximal number of bytes bounced through the tail of the file at once
+#define COMPACT_BOUNCE_BYTES (64 * 1024 * 1024)
+
+static int repoint(struct pictdb_file* db_file, const struct extent* extent, uint64_t to, uint32_t* first, uint32_t* last);
+static int move_batch(struct pictdb_file* db_file, const struct compaction* compaction, struct extent* batch, size_t count,
+                      const uint64_t* targets, int* moved);
+static int release_bounce(struct pictdb_file* db_file, const struct extent* batch, size_t count, uint64_t start, uint64_t end);
+static uint64_t table_end(const struct pictdb_file* db_file);
+
+/**
+ * @brief offset of the first byte after the metadata table
+ */
+static uint64_t table_end(const struct pictdb_file* db_file)
+{
+    return sizeof(struct pictdb_header) + (uint64_t) db_file->header.max_files * sizeof(struct pict_metadata);
+}
+
+/**
+ * @brief make every image using an extent point to its new place, the
+ *        images sharing an extent all have the same SHA, and widen the
+ *        range of modified slots
+ */
+static int repoint(struct pictdb_file* db_file, const struct extent* extent, uint64_t to, uint32_t* first, uint32_t* last)
+{
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    memcpy(SHA, db_file->metadata[extent->slot].SHA, SHA256_DIGEST_LENGTH);
+
+    long cursor = -1;
+    int slot = -1;
+    while((slot = index_next_sha(db_file, SHA, &cursor)) >= 0) {
+        int changed = 0;
+        int r = 0;
+        for(r = 0; r < NB_RES; r++) {
+            if(db_file->metadata[slot].offset[r] == extent->offset && db_file->metadata[slot].size[r] != 0) {
+                db_file->metadata[slot].offset[r] = to;
+                changed = 1;
+            }
+        }
+        if(changed) {
+            if(write_metadata(db_file, slot) != 0) {
+                return ERR_IO;
+            }
+            if((uint32_t) slot < *first) {
+                *first = slot;
+            }
+            if((uint32_t) slot > *last) {
+                *last = slot;
+            }
+        }
+    }
+    index_extent_move(db_file, extent->offset, to);
+    return 0;
+}
+
+/**
+ * @brief copy a batch of extents to the given offsets, then repoint the
+ *        images once the copies are durable
+ *
+ * Called without the lock: the targets of a batch never overlap a source
+ * still in use, so the extents are copied concurrently with the requests.
+ * The write lock is only held to repoint the metadata, which are written
+ * back after it is released: one fdatasync and one msync of the modified
+ * pages per batch.
+ *
+ * @param moved set to 1 if the images use the copies, to 0 if the
+ *        database changed since the plan was made
+ */
+static int move_batch(struct pictdb_file* db_file, const struct compaction* compaction, struct extent* batch, size_t count,
+                      const uint64_t* targets, int* moved)
+{
+    *moved = 0;
+    int fd = fileno(db_file->fpdb);
+    int res = extent_copy_all(fd, fd, batch, targets, count, compaction->nb_threads);
+    if(res == 0) {
+        res = sync_data(db_file);
+    }
+    if(res != 0) {
+        return res;
+    }
+
+    db_lock_write(db_file);
+    if(compaction->db_version != db_file->header.db_version) {
+        // the next step makes the plan again, the copies are dead bytes
+        db_unlock(db_file);
+        return 0;
+    }
+    uint32_t first = UINT32_MAX;
+    uint32_t last = 0;
+    size_t k = 0;
+    for(k = 0; res == 0 && k < count; k++) {
+        res = repoint(db_file, &batch[k], targets[k], &first, &last);
+        if(res == 0) {
+            batch[k].offset = targets[k];
+        }
+    }
+    db_unlock(db_file);
+
+    if(first <= last) {
+        int synced = sync_metadata_run(db_file, first, last - first + 1);
+        if(res == 0) {
+            res = synced;
+        }
+    }
+    *moved = (res == 0);
+    return res;
+}
+
+/**
+ * @brief give back the bounce region of a step once no image uses it: it
+ *        is truncated away, or punched and counted as dead bytes if images
+ *        were appended after it meanwhile
+ */
+static int release_bounce(struct pictdb_file* db_file, const struct extent* batch, size_t count, uint64_t start, uint64_t end)
+{
+    size_t k = 0;
+    for(k = 0; k < count; k++) {
+        if(batch[k].offset >= start && batch[k].offset < end) {
+            // repointed to the region, the next plan moves it down
+            return 0;
+        }
+    }
+
+    db_lock_write(db_file);
+    uint64_t file_end = 0;
+    int res = get_file_end(db_file, &file_end);
+    if(res == 0 && file_end == end) {
+        if(ftruncate(fileno(db_file->fpdb), start) != 0) {
+            res = ERR_IO;
+        }
+    } else if(res == 0) {
+        res = extent_punch(fileno(db_file->fpdb), start, (uint32_t) (end - start));
+        db_file->header.dead_bytes += end - start;
+        int written = write_header(db_file);
+        if(res == 0) {
+            res = written;
+        }
+    }
+    db_unlock(db_file);
+    return res;
+}
+
+/**
+ * @brief plan the compaction of a database
+ *
+ * @param db_file database to compact, opened for writing
+ * @param compaction state to initialize
+ * @param nb_threads number of threads copying the extents of a step
+ */
+int compact_begin(struct pictdb_file* db_file, struct compaction* compaction, unsigned int nb_threads)
+{
+    if(db_file == NULL || compaction == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    int res = index_ensure(db_file);
+    if(res != 0) {
+        return res;
+    }
+
+    res = extent_collect(db_file, UINT64_MAX, &(compaction->live));
+    if(res != 0) {
+        return res;
+    }
+
+    // live extents are packed in offset order right after the table
+    uint64_t write_offset = table_end(db_file);
+    size_t k = 0;
+    for(k = 0; k < compaction->live.count; k++) {
+        compaction->live.extents[k].new_offset = write_offset;
+        write_offset += compaction->live.extents[k].size;
+    }
+
+    compaction->next = 0;
+    compaction->db_version = db_file->header.db_version;
+    compaction->nb_threads = nb_threads > 0 ? nb_threads : 1;
+    return 0;
+}
+
+/**
+ * @brief tell whether every extent of a compaction reached its final place
+ *
+ * @param compaction state of the compaction
+ */
+int compact_done(const struct compaction* compaction)
+{
+    return compaction == NULL || compaction->next >= compaction->live.count;
+}
+
+/**
+ * @brief move the next extents of a compaction to their final place
+ *
+ * @param db_file database being compacted
+ * @param compaction state of the compaction
+ * @param max_extents maximal number of extents to move
+ */
+int compact_step(struct pictdb_file* db_file, struct compaction* compaction, size_t max_extents)
+{
+    if(db_file == NULL || compaction == NULL || max_extents == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    db_lock_write(db_file);
+
+    // images were inserted or deleted since the plan was made
+    if(compaction->db_version != db_file->header.db_version) {
+        compact_abort(compaction);
+        int res = compact_begin(db_file, compaction, compaction->nb_threads);
+        if(res != 0) {
+            db_unlock(db_file);
+            return res;
+        }
+    }
+
+    struct extent* extents = compaction->live.extents;
+    size_t count = compaction->live.count;
+
+    // the extents before the first dead byte are already in place
+    while(compaction->next < count && extents[compaction->next].offset == extents[compaction->next].new_offset) {
+        compaction->next++;
+    }
+    if(compaction->next >= count) {
+        db_unlock(db_file);
+        return 0;
+    }
+
+    struct extent* batch = &extents[compaction->next];
+    size_t remaining = count - compaction->next;
+    uint64_t first_source = batch[0].offset;
+
+    // largest batch whose destinations are all below its first source
+    size_t n = 0;
+    while(n < remaining && n < max_extents && batch[n].new_offset + batch[n].size <= first_source) {
+        n++;
+    }
+    int bounce = (n == 0);
+    if(bounce) {
+        uint64_t bytes = 0;
+        while(n < remaining && n < max_extents && (n == 0 || bytes + batch[n].size <= COMPACT_BOUNCE_BYTES)) {
+            bytes += batch[n].size;
+            n++;
+        }
+    }
+
+    uint64_t* targets = calloc(n, sizeof(uint64_t));
+    if(targets == NULL) {
+        db_unlock(db_file);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // the bounce region is reserved at the end of the file, above every
+    // live byte: the images appended meanwhile go after it
+    int res = 0;
+    size_t k = 0;
+    uint64_t bounce_start = 0;
+    uint64_t bounce_end = 0;
+    if(bounce) {
+        res = get_file_end(db_file, &bounce_start);
+        bounce_end = bounce_start;
+        for(k = 0; k < n; k++) {
+            targets[k] = bounce_end;
+            bounce_end += batch[k].size;
+        }
+        if(res == 0 && ftruncate(fileno(db_file->fpdb), bounce_end) != 0) {
+            res = ERR_IO;
+        }
+    }
+    db_unlock(db_file);
+    if(res != 0) {
+        free(targets);
+        return res;
+    }
+
+    int moved = 1;
+    if(bounce) {
+        res = move_batch(db_file, compaction, batch, n, targets, &moved);
+    }
+    if(res == 0 && moved) {
+        for(k = 0; k < n; k++) {
+            targets[k] = batch[k].new_offset;
+        }
+        res = move_batch(db_file, compaction, batch, n, targets, &moved);
+    }
+    free(targets);
+
+    // the batch left the bounce region and its new place is durable: the
+    // next step bounces through the same bytes
+    if(bounce) {
+        int released = release_bounce(db_file, batch, n, bounce_start, bounce_end);
+        if(res == 0) {
+            res = released;
+        }
+    }
+
+    if(res == 0 && moved) {
+        compaction->next += n;
+    }
+    return res;
+}
+
+/**
+ * @brief finish a compaction: update the header and truncate the file
+ *        after the last live byte
+ *
+ * @param db_file database being compacted
+ * @param compaction state of the compaction, freed
+ */
+int compact_end(struct pictdb_file* db_file, struct compaction* compaction)
+{
+    if(db_file == NULL || compaction == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    compact_abort(compaction);
+
+    // the live bytes, each shared extent counted once
+    struct extent_list live;
+    int res = extent_collect(db_file, UINT64_MAX, &live);
+    if(res != 0) {
+        return res;
+    }
+    uint64_t live_bytes = 0;
+    size_t k = 0;
+    for(k = 0; k < live.count; k++) {
+        live_bytes += live.extents[k].size;
+    }
+    extent_list_free(&live);
+
+    // images may have been appended after the compacted data
+    uint64_t end = table_end(db_file);
+    uint32_t i = 0;
+    int r = 0;
+    for(i = 0; i < db_file->header.max_files; i++) {
+        if(db_file->metadata[i].is_valid == NON_EMPTY) {
+            for(r = 0; r < NB_RES; r++) {
+                uint64_t extent_end = db_file->metadata[i].offset[r] + db_file->metadata[i].size[r];
+                if(db_file->metadata[i].size[r] != 0 && extent_end > end) {
+                    end = extent_end;
+                }
+            }
+        }
+    }
+
+    // the compacted extents are packed, but a bounce region left behind by
+    // a failed step, or holes below the images appended meanwhile, are not
+    uint64_t used = end - table_end(db_file);
+    db_file->header.dead_bytes = used > live_bytes ? used - live_bytes : 0;
+    ++(db_file->header.db_version);
+    res = write_header(db_file);
+    if(res == 0) {
+        res = sync_file(db_file);
+    }
+    if(res != 0) {
+        return res;
+    }
+
+    // the metadata are durable, nothing references the tail anymore
+    if(ftruncate(fileno(db_file->fpdb), end) != 0) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/**
+ * @brief tell whether the dead bytes of a database exceed the threshold
+ *        set in its header
+ *
+ * @param db_file database to check
+ */
+int compact_needed(struct pictdb_file* db_file)
+{
+    if(db_file == NULL || db_file->fpdb == NULL) {
+        return 0;
+    }
+    uint32_t threshold = db_file->header.gc_threshold;
+    if(threshold == 0 || threshold > MAX_GC_THRESHOLD || db_file->header.dead_bytes == 0) {
+        return 0;
+    }
+
+    // the live bytes are the data bytes that aren't dead
+    struct stat st;
+    if(fflush(db_file->fpdb) != 0 || fstat(fileno(db_file->fpdb), &st) != 0) {
+        return 0;
+    }
+    uint64_t size = st.st_size;
+    uint64_t data = size > table_end(db_file) ? size - table_end(db_file) : 0;
+    return data > 0 && db_file->header.dead_bytes * 100 >= (uint64_t) threshold * data;
+}
+
+/**
+ * @brief free the state of a compaction without finishing it
+ *
+ * @param compaction state to free
+ */
+void compact_abort(struct compaction* compaction)
+{
+    if(compaction != NULL) {
+        extent_list_free(&(compaction->live));
+        compaction->next = 0;
+    }
+}
+
+/**
+ * @brief compact a database in place, without a temporary file
+ *
+ * @param db_file database to compact, opened for writing
+ * @param nb_threads number of threads copying the extents
+ */
+int do_compact(struct pictdb_file* db_file, unsigned int nb_threads)
+{
+    if(db_file == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct compaction compaction;
+    db_lock_write(db_file);
+    int res = compact_begin(db_file, &compaction, nb_threads);
+    db_unlock(db_file);
+
+    // the steps take the lock themselves
+    while(res == 0 && !compact_done(&compaction)) {
+        res = compact_step(db_file, &compaction, COMPACT_STEP_EXTENTS);
+        if(res != 0) {
+            compact_abort(&compaction);
+        }
+    }
+    if(res == 0) {
+        db_lock_write(db_file);
+        res = compact_end(db_file, &compaction);
+        db_unlock(db_file);
+    }
+    return res;
+}
@@ -0,0 +1,95 @@
+/**
+ * @file db_compact.h
+ * @brief prototypes for the in-place compaction of a database
+ *
+ * A compaction slides the live extents down over the dead space, in
+ * offset order, then truncates the tail of the file. It runs in steps so
+ * that it can be interleaved with other operations on the database: the
+ * steps only hold the write lock to repoint the metadata. The database
+ * must not be grown or reconfigured while a compaction runs.
+ *
+ * @author Basile Thullen, Jeremy Hottinger
+ * @date 8 Jun 2016
+ */
+
+#ifndef DB_COMPACT_H
+#define DB_COMPACT_H
+
+#include "pictDB.h"
+#include "db_extent.h"
+
+// default number of extents moved by a compaction step
+#define COMPACT_STEP_EXTENTS 256
+
+/* State of an in-place compaction */
+struct compaction {
+    struct extent_list live; // live extents, new_offset is their final place
+    size_t next;             // first extent not at its final place yet
+    uint32_t db_version;     // version of the database the plan is valid for
+    unsigned int nb_threads; // number of threads copying the extents
+};
+
+/**
+ * @brief plan the compaction of a database, the caller holds its write
+ *        lock
+ *
+ * @param db_file database to compact, opened for writing
+ * @param compaction state to initialize
+ * @param nb_threads number of threads copying the extents of a step
+ *
+ * @return 0 if successful, error code if not
+ */
+int compact_begin(struct pictdb_file* db_file, struct compaction* compaction, unsigned int nb_threads);
+
+/**
+ * @brief move the next extents of a compaction to their final place
+ *
+ * If the database changed since the plan was made, the plan is made again
+ * first: the extents already moved stay where they are. The caller must
+ * not hold the lock of the database, the step takes it when needed.
+ *
+ * @param db_file database being compacted
+ * @param compaction state of the compaction
+ * @param max_extents maximal number of extents to move
+ *
+ * @return 0 if successful, error code if not
+ */
+int compact_step(struct pictdb_file* db_file, struct compaction* compaction, size_t max_extents);
+
+/**
+ * @brief tell whether every extent of a compaction reached its final place
+ *
+ * @param compaction state of the compaction
+ */
+int compact_done(const struct compaction* compaction);
+
+/**
+ * @brief finish a compaction: update the header and truncate the file
+ *        after the last live byte, the caller holds the write lock
+ *
+ * @param db_file database being compacted
+ * @param compaction state of the compaction, freed
+ *
+ * @return 0 if successful, error code if not
+ */
+int compact_end(struct pictdb_file* db_file, struct compaction* compaction);
+
+/**
+ * @brief tell whether the dead bytes of a database exceed the threshold
+ *        set in its header
+ *
+ * @param db_file database to check
+ *
+ * @return 1 if the database should be compacted, 0 otherwise
+ */
+int compact_needed(struct pictdb_file* db_file);
+
+/**
+ * @brief free the state of a compaction without finishing it, the
+ *        database stays valid
+ *
+ * @param compaction state to free
+ */
+void compact_abort(struct compaction* compaction);
+
+#endif
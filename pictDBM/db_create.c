@@ -7,6 +7,7 @@
  */
 
 #include "pictDB.h"
+#include "db_index.h"
 
 #include <string.h> // for strncpy
 
@@ -31,6 +32,7 @@ int do_create(const char* filename, struct pictdb_file* db_file)
     db_file->header.db_name[name_len] = '\0';
     db_file->header.db_version = 0;
     db_file->header.num_files = 0;
+    db_file->header.dead_bytes = 0;
 
     // Initialize metadata
     db_file->metadata = calloc(db_file->header.max_files, sizeof(struct pict_metadata));
@@ -38,6 +40,10 @@ int do_create(const char* filename, struct pictdb_file* db_file)
         return ERR_OUT_OF_MEMORY;
     }
 
+    db_file->map = NULL;
+    db_file->map_size = 0;
+    index_clear(db_file);
+
     db_file->fpdb = fopen(filename, "wb+");
     if(db_file == NULL) {
         free(db_file->metadata);
@@ -57,10 +63,12 @@ int do_create(const char* filename, struct pictdb_file* db_file)
 
     //fclose(db_file->fpdb);
 
-    if(items != db_file->header.max_files+1) {
+    // the handle only does positionless I/O from now on
+    if(items != db_file->header.max_files+1 || fflush(db_file->fpdb) != 0) {
         free(db_file->metadata);
         return ERR_IO;
     }
+    pthread_rwlock_init(&(db_file->lock), NULL);
 
     printf("%d items written\n", items);
 
@@ -7,6 +7,42 @@
  */
 
 #include "pictDB.h"
+#include "db_index.h"
+#include "db_extent.h"
+
+static int punch_extents(struct pictdb_file* file, const struct pict_metadata* metadata);
+static int delete_locked(const char* name, struct pictdb_file* file);
+
+/**
+ * @brief punch holes over the extents of a deleted image that no other
+ *        image uses anymore
+ *
+ * The metadata no longer referencing the extents must be durable first:
+ * after a crash, a valid entry must never point to a hole.
+ */
+static int punch_extents(struct pictdb_file* file, const struct pict_metadata* metadata)
+{
+    int dead[NB_RES];
+    int nb_dead = 0;
+    int r = 0;
+    for(r = 0; r < NB_RES; r++) {
+        dead[r] = metadata->offset[r] != 0 && metadata->size[r] != 0
+                  && index_extent_refs(file, metadata->offset[r]) == 0;
+        nb_dead += dead[r];
+    }
+    if(nb_dead == 0) {
+        return 0;
+    }
+
+    int res = sync_file(file);
+    int fd = fileno(file->fpdb);
+    for(r = 0; r < NB_RES && res == 0; r++) {
+        if(dead[r]) {
+            res = extent_punch(fd, metadata->offset[r], metadata->size[r]);
+        }
+    }
+    return res;
+}
 
 /**
  * @brief Delete an image from a database file
@@ -26,38 +62,52 @@ int do_delete(const char* name, struct pictdb_file* file)
         return ERR_INVALID_ARGUMENT;
     }
 
-    // find metadata corresponding to image
-    int index = -1;
-    size_t cur = 0;
-    // find the index of the image to delete
-    while(index < 0 && cur < file->header.max_files) {
-        // Compare the name given in parameter with the image name
-        if(file->metadata[cur].is_valid == NON_EMPTY && strcmp(file->metadata[cur].pict_id, name) == 0) {
-            index = cur;
-        }
-        cur ++;
+    db_lock_write(file);
+    int res = delete_locked(name, file);
+    db_unlock(file);
+    return res;
+}
+
+/**
+ * @brief Delete an image from a database file, the caller holds its write
+ *        lock
+ */
+static int delete_locked(const char* name, struct pictdb_file* file)
+{
+    int res = index_ensure(file);
+    if(res != 0) {
+        return res;
     }
 
+    // find the index of the image to delete
+    int index = index_find_id(file, name);
+
     // picture id not found
     if(index < 0) {
         return ERR_FILE_NOT_FOUND;
     }
 
+    // the reference counts of the extents drop with the slot
+    index_remove(file, index);
     file->metadata[index].is_valid = EMPTY;
+    struct pict_metadata deleted = file->metadata[index];
+
+    int r = 0;
+    for(r = 0; r < NB_RES; r++) {
+        if(deleted.offset[r] != 0 && deleted.size[r] != 0 && index_extent_refs(file, deleted.offset[r]) == 0) {
+            file->header.dead_bytes += deleted.size[r];
+        }
+    }
 
     // save everything back on the disk
     if(file->fpdb == NULL) {
         return ERR_IO;
     }
 
-    // sets the file position to the metadata struct
-    if(fseek(file->fpdb, sizeof(struct pictdb_header) + sizeof(struct pict_metadata) * index, SEEK_SET) != 0) {
-        return ERR_IO;
-    }
     // write the metadata
-    int items = fwrite(&(file->metadata[index]), sizeof(struct pict_metadata), 1, file->fpdb);
-    if(items != 1) {
-        return ERR_IO;
+    res = write_metadata(file, index);
+    if(res != 0) {
+        return res;
     }
 
     // update header
@@ -67,13 +117,11 @@ int do_delete(const char* name, struct pictdb_file* file)
     ++(file->header.db_version);
 
     // write header to disk
-    if(fseek(file->fpdb, 0, SEEK_SET) != 0) {
-        return ERR_IO;
-    }
-    items = fwrite(&(file->header), sizeof(struct pictdb_header), 1, file->fpdb);
-    if(items != 1) {
-        return ERR_IO;
+    res = write_header(file);
+    if(res != 0) {
+        return res;
     }
 
-    return 0;
+    // reclaim right away the extents no image uses anymore
+    return punch_extents(file, &deleted);
 }
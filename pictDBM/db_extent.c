@@ -0,0 +1,407 @@
+/**
+ * @file db_extent.c
+ * @brief manipulation of the image extents of a database
+ *
+ * @author Basile Thullen, Jeremy Hottinger
+ * @date 6 Jun 2016
+ */
+
+#include "db_extent.h"
+
+#include <unistd.h>     // for pread, pwrite
+#include <fcntl.h>      // for fallocate
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>   // for fstat
+#ifdef __linux__
+#include <sys/ioctl.h>  // for ioctl
+#include <linux/fs.h>   // for FICLONERANGE
+#endif
+
+// size of the buffer used to copy extents
+#define COPY_BUFFER_SIZE (64 * 1024)
+
+/* Run of extents copied by one thread of extent_copy_all */
+struct copy_run {
+    int from_fd;
+    int to_fd;
+    const struct extent* extents;
+    const uint64_t* targets;
+    size_t first;
+    size_t last;
+    int threaded; // whether the run got its own thread
+    int res;
+};
+
+static int extent_cmp(const void* a, const void* b);
+static void* copy_run_thread(void* arg);
+static int clone_range(int from_fd, uint64_t from_offset, int to_fd, uint64_t to_offset, uint32_t size);
+static uint32_t kernel_copy(int from_fd, uint64_t from_offset, int to_fd, uint64_t to_offset, uint32_t size);
+
+/**
+ * @brief order extents by offset
+ */
+static int extent_cmp(const void* a, const void* b)
+{
+    const struct extent* ea = a;
+    const struct extent* eb = b;
+    return (ea->offset > eb->offset) - (ea->offset < eb->offset);
+}
+
+/**
+ * @brief collect the distinct extents of the valid images of a database
+ *        starting below a given offset
+ *
+ * @param db_file database whose extents are collected
+ * @param below only the extents starting before this offset are kept
+ * @param list return argument, sorted by offset and without duplicates
+ */
+int extent_collect(const struct pictdb_file* db_file, uint64_t below, struct extent_list* list)
+{
+    if(db_file == NULL || list == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    list->count = 0;
+    list->extents = calloc((size_t) db_file->header.max_files * NB_RES + 1, sizeof(struct extent));
+    if(list->extents == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    uint32_t i = 0;
+    int r = 0;
+    for(i = 0; i < db_file->header.max_files; i++) {
+        if(db_file->metadata[i].is_valid == NON_EMPTY) {
+            for(r = 0; r < NB_RES; r++) {
+                uint64_t offset = db_file->metadata[i].offset[r];
+                if(offset != 0 && db_file->metadata[i].size[r] != 0 && offset < below) {
+                    list->extents[list->count].offset = offset;
+                    list->extents[list->count].new_offset = offset;
+                    list->extents[list->count].size = db_file->metadata[i].size[r];
+                    list->extents[list->count].slot = i;
+                    list->count++;
+                }
+            }
+        }
+    }
+    qsort(list->extents, list->count, sizeof(struct extent), extent_cmp);
+
+    // deduplicated images share their extents, keep each of them once
+    size_t unique = 0;
+    size_t k = 0;
+    for(k = 0; k < list->count; k++) {
+        if(unique == 0 || list->extents[unique - 1].offset != list->extents[k].offset) {
+            list->extents[unique++] = list->extents[k];
+        }
+    }
+    list->count = unique;
+
+    return 0;
+}
+
+/**
+ * @brief free the extents of a list
+ *
+ * @param list list to free
+ */
+void extent_list_free(struct extent_list* list)
+{
+    if(list != NULL) {
+        free(list->extents);
+        list->extents = NULL;
+        list->count = 0;
+    }
+}
+
+/**
+ * @brief find an extent given its current offset
+ *
+ * @param list list to search in
+ * @param offset current offset of the extent
+ */
+struct extent* extent_find(const struct extent_list* list, uint64_t offset)
+{
+    if(list == NULL || list->count == 0) {
+        return NULL;
+    }
+    struct extent key;
+    key.offset = offset;
+    return bsearch(&key, list->extents, list->count, sizeof(struct extent), extent_cmp);
+}
+
+/**
+ * @brief rewrite the offsets of a metadata entry after its extents moved
+ *
+ * @param list list of moved extents, with their new offsets
+ * @param metadata metadata to update
+ */
+int extent_remap(const struct extent_list* list, struct pict_metadata* metadata)
+{
+    int changed = 0;
+    int r = 0;
+    for(r = 0; r < NB_RES; r++) {
+        if(metadata->offset[r] != 0 && metadata->size[r] != 0) {
+            struct extent* extent = extent_find(list, metadata->offset[r]);
+            if(extent != NULL && extent->new_offset != metadata->offset[r]) {
+                metadata->offset[r] = extent->new_offset;
+                changed = 1;
+            }
+        }
+    }
+    return changed;
+}
+
+/**
+ * @brief share the blocks of an extent with a reflink, only possible when
+ *        both ranges and the size are multiple of the filesystem block
+ *
+ * Nothing aligns the extents of a database: they are packed back to back
+ * to waste no byte, so this mostly fails and the copy falls back to
+ * copy_file_range.
+ *
+ * @return 0 if the extent was cloned, -1 if it must be copied
+ */
+static int clone_range(int from_fd, uint64_t from_offset, int to_fd, uint64_t to_offset, uint32_t size)
+{
+#if defined(__linux__) && defined(FICLONERANGE)
+    struct stat st;
+    if(fstat(to_fd, &st) != 0 || st.st_blksize <= 0) {
+        return -1;
+    }
+    uint64_t block = st.st_blksize;
+    if(from_offset % block != 0 || to_offset % block != 0 || size % block != 0) {
+        return -1;
+    }
+
+    struct file_clone_range range;
+    range.src_fd = from_fd;
+    range.src_offset = from_offset;
+    range.src_length = size;
+    range.dest_offset = to_offset;
+    return ioctl(to_fd, FICLONERANGE, &range) == 0 ? 0 : -1;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * @brief copy bytes inside the kernel with copy_file_range
+ *
+ * @return number of bytes copied, the caller copies the remaining ones
+ */
+static uint32_t kernel_copy(int from_fd, uint64_t from_offset, int to_fd, uint64_t to_offset, uint32_t size)
+{
+    uint32_t done = 0;
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+    while(done < size) {
+        loff_t in = from_offset + done;
+        loff_t out = to_offset + done;
+        ssize_t copied = copy_file_range(from_fd, &in, to_fd, &out, size - done, 0);
+        if(copied <= 0) {
+            // unsupported, cross-device or overlapping ranges
+            break;
+        }
+        done += copied;
+    }
+#endif
+    return done;
+}
+
+/**
+ * @brief copy the bytes of an extent between two file descriptors
+ *
+ * @param from_fd descriptor to copy from
+ * @param from_offset offset of the bytes to copy
+ * @param to_fd descriptor to copy to
+ * @param to_offset offset at which to write the bytes
+ * @param size number of bytes to copy
+ */
+int extent_copy_fd(int from_fd, uint64_t from_offset, int to_fd, uint64_t to_offset, uint32_t size)
+{
+    if(from_fd < 0 || to_fd < 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    if(clone_range(from_fd, from_offset, to_fd, to_offset, size) == 0) {
+        return 0;
+    }
+
+    uint32_t done = kernel_copy(from_fd, from_offset, to_fd, to_offset, size);
+    if(done == size) {
+        return 0;
+    }
+
+    char* buffer = malloc(size - done < COPY_BUFFER_SIZE ? size - done : COPY_BUFFER_SIZE);
+    if(buffer == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // chunks are copied from the start, which is also safe when an extent
+    // slides down over itself
+    while(done < size) {
+        size_t chunk = size - done < COPY_BUFFER_SIZE ? size - done : COPY_BUFFER_SIZE;
+        ssize_t got = pread(from_fd, buffer, chunk, from_offset + done);
+        if(got <= 0) {
+            free(buffer);
+            return ERR_IO;
+        }
+        ssize_t written = 0;
+        while(written < got) {
+            ssize_t w = pwrite(to_fd, buffer + written, got - written, to_offset + done + written);
+            if(w <= 0) {
+                free(buffer);
+                return ERR_IO;
+            }
+            written += w;
+        }
+        done += got;
+    }
+
+    free(buffer);
+    return 0;
+}
+
+/**
+ * @brief copy a run of extents, body of the threads of extent_copy_all
+ */
+static void* copy_run_thread(void* arg)
+{
+    struct copy_run* run = arg;
+    size_t k = 0;
+    for(k = run->first; k < run->last && run->res == 0; k++) {
+        uint64_t target = run->targets != NULL ? run->targets[k] : run->extents[k].new_offset;
+        run->res = extent_copy_fd(run->from_fd, run->extents[k].offset, run->to_fd, target, run->extents[k].size);
+    }
+    return NULL;
+}
+
+/**
+ * @brief copy several extents with a pool of threads
+ *
+ * @param from_fd descriptor to copy from
+ * @param to_fd descriptor to copy to
+ * @param extents extents to copy, from their offset
+ * @param targets offsets at which to write the extents, NULL for new_offset
+ * @param count number of extents
+ * @param nb_threads number of threads to use
+ */
+int extent_copy_all(int from_fd, int to_fd, const struct extent* extents, const uint64_t* targets, size_t count, unsigned int nb_threads)
+{
+    if(extents == NULL && count > 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if(nb_threads == 0) {
+        nb_threads = 1;
+    }
+    if(nb_threads > count) {
+        nb_threads = count > 0 ? count : 1;
+    }
+
+    struct copy_run* runs = calloc(nb_threads, sizeof(struct copy_run));
+    pthread_t* threads = calloc(nb_threads, sizeof(pthread_t));
+    if(runs == NULL || threads == NULL) {
+        free(runs);
+        free(threads);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    uint64_t total = 0;
+    size_t k = 0;
+    for(k = 0; k < count; k++) {
+        total += extents[k].size;
+    }
+
+    // split the extents in runs of about total / nb_threads bytes
+    uint64_t bytes = 0;
+    size_t first = 0;
+    unsigned int t = 0;
+    for(t = 0; t < nb_threads; t++) {
+        uint64_t limit = total * (t + 1) / nb_threads;
+        size_t last = first;
+        while(last < count && (t == nb_threads - 1 || bytes < limit)) {
+            bytes += extents[last].size;
+            last++;
+        }
+        runs[t].from_fd = from_fd;
+        runs[t].to_fd = to_fd;
+        runs[t].extents = extents;
+        runs[t].targets = targets;
+        runs[t].first = first;
+        runs[t].last = last;
+        runs[t].threaded = 0;
+        runs[t].res = 0;
+        first = last;
+    }
+
+    // the first run is copied by the calling thread
+    for(t = 1; t < nb_threads; t++) {
+        runs[t].threaded = pthread_create(&threads[t], NULL, copy_run_thread, &runs[t]) == 0;
+    }
+    for(t = 0; t < nb_threads; t++) {
+        if(!runs[t].threaded) {
+            copy_run_thread(&runs[t]);
+        }
+    }
+
+    int res = 0;
+    for(t = 0; t < nb_threads; t++) {
+        if(runs[t].threaded) {
+            pthread_join(threads[t], NULL);
+        }
+        if(res == 0) {
+            res = runs[t].res;
+        }
+    }
+
+    free(runs);
+    free(threads);
+    return res;
+}
+
+/**
+ * @brief give the blocks of an extent back to the filesystem
+ *
+ * @param fd descriptor of the database
+ * @param offset offset of the extent
+ * @param size size of the extent
+ */
+int extent_punch(int fd, uint64_t offset, uint32_t size)
+{
+    if(fd < 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    if(size > 0 && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) != 0
+       && errno != EOPNOTSUPP && errno != ENOSYS) {
+        return ERR_IO;
+    }
+#endif
+    return 0;
+}
+
+/**
+ * @brief copy the bytes of an extent from a file to another one
+ *
+ * @param from file to copy from
+ * @param from_offset offset of the bytes to copy
+ * @param to file to copy to
+ * @param to_offset offset at which to write the bytes
+ * @param size number of bytes to copy
+ */
+int extent_copy(FILE* from, uint64_t from_offset, FILE* to, uint64_t to_offset, uint32_t size)
+{
+    if(from == NULL || to == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // the copy bypasses the streams: pending writes must reach the files
+    // and buffered reads must not outlive the copy
+    if(fflush(from) != 0 || fflush(to) != 0) {
+        return ERR_IO;
+    }
+    int res = extent_copy_fd(fileno(from), from_offset, fileno(to), to_offset, size);
+    if(fflush(to) != 0 && res == 0) {
+        res = ERR_IO;
+    }
+    return res;
+}
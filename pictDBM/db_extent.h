@@ -0,0 +1,141 @@
+/**
+ * @file db_extent.h
+ * @brief prototypes for the manipulation of the image extents of a database
+ *
+ * An extent is a contiguous range of image bytes addressed by one or more
+ * metadata entries (deduplicated images share their extents). Extents are
+ * identified by their offset in the database file.
+ *
+ * @author Basile Thullen, Jeremy Hottinger
+ * @date 6 Jun 2016
+ */
+
+#ifndef DB_EXTENT_H
+#define DB_EXTENT_H
+
+#include "pictDB.h"
+
+/* A distinct extent of image data and the offset it must be moved to */
+struct extent {
+    uint64_t offset;
+    uint64_t new_offset;
+    uint32_t size;
+    uint32_t slot; // one of the images using the extent
+};
+
+/* Distinct extents of a database, sorted by offset */
+struct extent_list {
+    struct extent* extents;
+    size_t count;
+};
+
+/**
+ * @brief collect the distinct extents of the valid images of a database
+ *        starting below a given offset
+ *
+ * @param db_file database whose extents are collected
+ * @param below only the extents starting before this offset are kept
+ * @param list return argument, sorted by offset and without duplicates
+ *
+ * @return 0 if successful, error code if not
+ */
+int extent_collect(const struct pictdb_file* db_file, uint64_t below, struct extent_list* list);
+
+/**
+ * @brief free the extents of a list
+ *
+ * @param list list to free
+ */
+void extent_list_free(struct extent_list* list);
+
+/**
+ * @brief find an extent given its current offset
+ *
+ * @param list list to search in
+ * @param offset current offset of the extent
+ *
+ * @return the extent, NULL if it isn't in the list
+ */
+struct extent* extent_find(const struct extent_list* list, uint64_t offset);
+
+/**
+ * @brief rewrite the offsets of a metadata entry after its extents moved
+ *
+ * @param list list of moved extents, with their new offsets
+ * @param metadata metadata to update
+ *
+ * @return 1 if at least one offset changed, 0 otherwise
+ */
+int extent_remap(const struct extent_list* list, struct pict_metadata* metadata);
+
+/**
+ * @brief copy the bytes of an extent between two file descriptors, or to
+ *        another offset of the same descriptor, without going through
+ *        userspace when the kernel can do the copy
+ *
+ * Reflinks (FICLONERANGE) are tried first, then copy_file_range, and
+ * pread/pwrite as the last resort. A reflink needs both offsets and the
+ * size to be multiples of the filesystem block; images are appended
+ * back to back, so in practice only the rare aligned extent is cloned
+ * and the others go through copy_file_range.
+ * The descriptors aren't moved, so disjoint copies can run concurrently.
+ *
+ * @param from_fd descriptor to copy from
+ * @param from_offset offset of the bytes to copy
+ * @param to_fd descriptor to copy to
+ * @param to_offset offset at which to write the bytes
+ * @param size number of bytes to copy
+ *
+ * @return 0 if successful, error code if not
+ */
+int extent_copy_fd(int from_fd, uint64_t from_offset, int to_fd, uint64_t to_offset, uint32_t size);
+
+/**
+ * @brief copy several extents with a pool of threads, each thread copying
+ *        a contiguous run of extents of about the same number of bytes
+ *
+ * The destination ranges must be disjoint from each other and from the
+ * source ranges that are still needed.
+ *
+ * @param from_fd descriptor to copy from
+ * @param to_fd descriptor to copy to
+ * @param extents extents to copy, from their offset
+ * @param targets offsets at which to write the extents, NULL to use their
+ *        new_offset
+ * @param count number of extents
+ * @param nb_threads number of threads to use
+ *
+ * @return 0 if successful, error code if not
+ */
+int extent_copy_all(int from_fd, int to_fd, const struct extent* extents, const uint64_t* targets, size_t count, unsigned int nb_threads);
+
+/**
+ * @brief give the blocks of an extent back to the filesystem, the size of
+ *        the file is kept and the range reads as zeros
+ *
+ * The hole is punched on a best effort basis: nothing happens when the
+ * filesystem doesn't support it, the bytes are then reclaimed by gc.
+ *
+ * @param fd descriptor of the database
+ * @param offset offset of the extent
+ * @param size size of the extent
+ *
+ * @return 0 if successful or unsupported, error code if not
+ */
+int extent_punch(int fd, uint64_t offset, uint32_t size);
+
+/**
+ * @brief copy the bytes of an extent from a file to another one, or to
+ *        another offset of the same file, see extent_copy_fd
+ *
+ * @param from file to copy from
+ * @param from_offset offset of the bytes to copy
+ * @param to file to copy to
+ * @param to_offset offset at which to write the bytes
+ * @param size number of bytes to copy
+ *
+ * @return 0 if successful, error code if not
+ */
+int extent_copy(FILE* from, uint64_t from_offset, FILE* to, uint64_t to_offset, uint32_t size);
+
+#endif
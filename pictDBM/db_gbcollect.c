@@ -2,73 +2,113 @@
  * @file db_gbcollect.c
  * @brief pictDB library: garbage collecting
  *
+ * The live extents are copied byte for byte into a new database, packed in
+ * their original order right after the metadata table. Images are never
+ * decoded again: only the offsets of the metadata are rewritten. The layout
+ * is known up front, so the extents are copied by several threads at once.
+ *
  * @author Basile Thullen, Jeremy Hottinger
  * @date 30 May 2016
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>     // for fsync
+#include <fcntl.h>      // for open
 #include "pictDB.h"
-#include "image_content.h"
+#include "db_extent.h"
 
 int copy_and_delete(char* old, char* new);
-int check_hole(struct pictdb_file* file);
+static int sync_parent_dir(const char* filename);
+static int gbcollect_locked(struct pictdb_file* db_file, char* orig_filename, char* new_filename, unsigned int nb_threads);
 
-int do_gbcollect(struct pictdb_file* db_file, char* orig_filename, char* new_filename)
+int do_gbcollect(struct pictdb_file* db_file, char* orig_filename, char* new_filename, unsigned int nb_threads)
 {
+    if(db_file == NULL || orig_filename == NULL || new_filename == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
 
-    // create new temporary pictdb_file
-    struct pictdb_file new_db_file;
+    // the file is replaced under the handle: no one may use it meanwhile
+    db_lock_write(db_file);
+    int res = gbcollect_locked(db_file, orig_filename, new_filename, nb_threads);
+    db_unlock(db_file);
+    return res;
+}
 
-    new_db_file.header.max_files = db_file->header.max_files;
-    new_db_file.header.res_resized[0] = db_file->header.res_resized[0];
-    new_db_file.header.res_resized[1] = db_file->header.res_resized[1];
-    new_db_file.header.res_resized[2] = db_file->header.res_resized[2];
-    new_db_file.header.res_resized[3] = db_file->header.res_resized[3];
+/**
+ * @brief copy the live extents into a new database replacing the old one,
+ *        the caller holds the write lock of the old one
+ */
+static int gbcollect_locked(struct pictdb_file* db_file, char* orig_filename, char* new_filename, unsigned int nb_threads)
+{
+    uint32_t max_files = db_file->header.max_files;
+    uint64_t table_end = sizeof(struct pictdb_header) + (uint64_t) max_files * sizeof(struct pict_metadata);
 
-    do_create(new_filename, &new_db_file);
+    // compute the new layout: live extents packed in offset order
+    struct extent_list live;
+    int res = extent_collect(db_file, UINT64_MAX, &live);
+    if(res != 0) {
+        return res;
+    }
 
-    uint32_t max_files = db_file->header.max_files;
+    uint64_t write_offset = table_end;
+    size_t k = 0;
+    for(k = 0; k < live.count; k++) {
+        live.extents[k].new_offset = write_offset;
+        write_offset += live.extents[k].size;
+    }
 
-    int res = 0;
-    int new_db_index = 0;
-    int i;
-    for(i = 0; i < max_files; i ++) {
-        if(db_file->metadata[i].is_valid == 1) { // there is a valid image here
-            int offset_orig = db_file->metadata[i].offset[RES_ORIG];
-            char* img_array;
-            uint32_t size;
-
-            res = do_read(db_file->metadata[i].pict_id, RES_ORIG, &img_array, &size, db_file);
-            if(res != 0) {
-                remove(new_filename);
-                return res;
-            }
-
-            res = do_insert(img_array, size, db_file->metadata[i].pict_id, &new_db_file);
-            if(res != 0) {
-                remove(new_filename);
-                return res;
-            }
-
-            if(db_file->metadata[i].size[RES_SMALL] != 0 || db_file->metadata[i].offset[RES_SMALL] != 0) {
-                res = lazily_resize(RES_SMALL, &new_db_file, new_db_index);
-                if(res != 0) {
-                    remove(new_filename);
-                    return res;
-                }
-            }
-
-            if(db_file->metadata[i].size[RES_THUMB] != 0 || db_file->metadata[i].offset[RES_THUMB] != 0) {
-                res = lazily_resize(RES_THUMB, &new_db_file, new_db_index);
-                if(res != 0) {
-                    remove(new_filename);
-                    return res;
-                }
-            }
-            new_db_index ++;
+    // metadata of the new database, empty slots are cleared
+    struct pict_metadata* metadata = calloc(max_files, sizeof(struct pict_metadata));
+    if(metadata == NULL) {
+        extent_list_free(&live);
+        return ERR_OUT_OF_MEMORY;
+    }
+    uint32_t i = 0;
+    for(i = 0; i < max_files; i++) {
+        if(db_file->metadata[i].is_valid == NON_EMPTY) {
+            metadata[i] = db_file->metadata[i];
+            extent_remap(&live, &metadata[i]);
         }
     }
-    new_db_file.header.db_version = db_file->header.db_version;
+
+    FILE* new_fp = fopen(new_filename, "wb+");
+    if(new_fp == NULL) {
+        free(metadata);
+        extent_list_free(&live);
+        return ERR_IO;
+    }
+
+    // copy the extents first, the table makes them reachable
+    if(fflush(db_file->fpdb) != 0) {
+        res = ERR_IO;
+    } else {
+        res = extent_copy_all(fileno(db_file->fpdb), fileno(new_fp), live.extents, NULL, live.count, nb_threads);
+    }
+    extent_list_free(&live);
+
+    struct pictdb_header header = db_file->header;
+    header.dead_bytes = 0;
+    if(res == 0) {
+        if(fseeko(new_fp, 0, SEEK_SET) != 0
+           || fwrite(&header, sizeof(struct pictdb_header), 1, new_fp) != 1
+           || fwrite(metadata, sizeof(struct pict_metadata), max_files, new_fp) != max_files) {
+            res = ERR_IO;
+        }
+    }
+    free(metadata);
+
+    // the new file must be on the disk before it replaces the old one
+    if(res == 0 && (fflush(new_fp) != 0 || fsync(fileno(new_fp)) != 0)) {
+        res = ERR_IO;
+    }
+    if(fclose(new_fp) != 0 && res == 0) {
+        res = ERR_IO;
+    }
+    if(res != 0) {
+        remove(new_filename);
+        return res;
+    }
 
     res = copy_and_delete(orig_filename, new_filename);
     if(res != 0) {
@@ -78,13 +118,47 @@ int do_gbcollect(struct pictdb_file* db_file, char* orig_filename, char* new_fil
     return 0;
 }
 
+/**
+ * @brief replace the old database file by the new one, rename is atomic
+ *        so the database is never missing
+ *
+ * The new file is already synced; the directory is synced after the
+ * rename so that the replacement itself survives a crash.
+ */
 int copy_and_delete(char* old, char* new)
 {
-    if(remove(old) != 0) {
+    if(rename(new, old) != 0) {
         return ERR_IO;
     }
-    if(rename(new, old) != 0) {
+    return sync_parent_dir(old);
+}
+
+/**
+ * @brief sync the directory holding a file, making its entries durable
+ *
+ * @param filename path of the file whose directory must be synced
+ */
+static int sync_parent_dir(const char* filename)
+{
+    const char* slash = strrchr(filename, '/');
+    char* dir = NULL;
+    if(slash == NULL) {
+        dir = strdup(".");
+    } else if(slash == filename) {
+        dir = strdup("/");
+    } else {
+        dir = strndup(filename, slash - filename);
+    }
+    if(dir == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    free(dir);
+    if(fd < 0) {
         return ERR_IO;
     }
-    return 0;
+    int res = fsync(fd) == 0 ? 0 : ERR_IO;
+    close(fd);
+    return res;
 }
@@ -0,0 +1,154 @@
+/**
+ * @file db_grow.c
+ * @brief pictDB library: do_grow implementation.
+ *
+ * The metadata table is enlarged in place: only the image extents lying
+ * where the new metadata entries will be are moved to the end of the file,
+ * every other byte of the database stays where it is.
+ *
+ * @author Basile Thullen, Jeremy Hottinger
+ * @date 4 Jun 2016
+ */
+
+#include <unistd.h>
+#include "pictDB.h"
+#include "db_extent.h"
+
+static int grow_locked(struct pictdb_file* db_file, uint32_t new_max_files);
+
+/**
+ * @brief enlarge the metadata table of a database without rewriting it
+ *
+ * The extents overlapping the new metadata entries are first copied past
+ * the end of the file and made durable, then the metadata referencing
+ * them are updated and made durable. Only then are the old bytes cleared
+ * for the new entries and the header updated, so an interruption leaves
+ * a valid database of the old size.
+ *
+ * @param db_file opened database to grow
+ * @param new_max_files new maximum number of images
+ */
+int do_grow(struct pictdb_file* db_file, uint32_t new_max_files)
+{
+    if(db_file == NULL || db_file->fpdb == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    db_lock_write(db_file);
+    int res = grow_locked(db_file, new_max_files);
+    db_unlock(db_file);
+    return res;
+}
+
+/**
+ * @brief enlarge the metadata table of a database, the caller holds its
+ *        write lock
+ */
+static int grow_locked(struct pictdb_file* db_file, uint32_t new_max_files)
+{
+    if(new_max_files <= db_file->header.max_files || new_max_files > MAX_MAX_FILES) {
+        return ERR_MAX_FILES;
+    }
+
+    uint32_t old_max_files = db_file->header.max_files;
+    uint64_t table_end = sizeof(struct pictdb_header) + (uint64_t) new_max_files * sizeof(struct pict_metadata);
+
+    // collect the distinct live extents starting before the new table end
+    struct extent_list moved;
+    int res = extent_collect(db_file, table_end, &moved);
+    if(res != 0) {
+        return res;
+    }
+
+    // the moved extents go after both the current data and the new table
+    uint64_t file_end = 0;
+    res = get_file_end(db_file, &file_end);
+    if(res != 0) {
+        extent_list_free(&moved);
+        return res;
+    }
+    uint64_t write_offset = file_end > table_end ? file_end : table_end;
+
+    // the old bytes of a moved extent past the new table are left dead,
+    // the others become metadata entries
+    uint64_t dead_bytes = 0;
+    size_t k = 0;
+    for(k = 0; k < moved.count; k++) {
+        moved.extents[k].new_offset = write_offset;
+        res = extent_copy(db_file->fpdb, moved.extents[k].offset, db_file->fpdb, write_offset, moved.extents[k].size);
+        if(res != 0) {
+            extent_list_free(&moved);
+            return res;
+        }
+        write_offset += moved.extents[k].size;
+
+        uint64_t extent_end = moved.extents[k].offset + moved.extents[k].size;
+        if(extent_end > table_end) {
+            dead_bytes += extent_end - table_end;
+        }
+    }
+
+    // the copies must be on the disk before any metadata points to them
+    res = sync_data(db_file);
+    if(res != 0) {
+        extent_list_free(&moved);
+        return res;
+    }
+
+    // repoint every image using a moved extent
+    uint32_t first = old_max_files;
+    uint32_t last = 0;
+    uint32_t i = 0;
+    for(i = 0; i < old_max_files; i++) {
+        if(db_file->metadata[i].is_valid == NON_EMPTY && extent_remap(&moved, &(db_file->metadata[i]))) {
+            if(write_metadata(db_file, i) != 0) {
+                extent_list_free(&moved);
+                return ERR_IO;
+            }
+            first = i < first ? i : first;
+            last = i;
+        }
+    }
+    extent_list_free(&moved);
+
+    // and no metadata may point to the old bytes once they are cleared
+    if(first <= last) {
+        res = sync_metadata_run(db_file, first, last - first + 1);
+        if(res != 0) {
+            return res;
+        }
+    }
+
+    // clear the new metadata entries at once
+    size_t table_size = (size_t)(new_max_files - old_max_files) * sizeof(struct pict_metadata);
+    char* empty = calloc(1, table_size);
+    if(empty == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    off_t offset = sizeof(struct pictdb_header) + (uint64_t) old_max_files * sizeof(struct pict_metadata);
+    ssize_t written = pwrite(fileno(db_file->fpdb), empty, table_size, offset);
+    free(empty);
+    if(written < 0 || (size_t) written != table_size) {
+        return ERR_IO;
+    }
+    res = sync_data(db_file);
+    if(res != 0) {
+        return res;
+    }
+
+    // the new size is only visible once everything else is written
+    db_file->header.max_files = new_max_files;
+    db_file->header.dead_bytes += dead_bytes;
+    ++(db_file->header.db_version);
+    res = write_header(db_file);
+    if(res == 0) {
+        res = sync_file(db_file);
+    }
+    if(res != 0) {
+        db_file->header.max_files = old_max_files;
+        db_file->header.dead_bytes -= dead_bytes;
+        return res;
+    }
+
+    return reload_metadata(db_file);
+}
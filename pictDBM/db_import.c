@@ -0,0 +1,326 @@
+/**
+ * @file db_import.c
+ * @brief pictDB library: bulk import of a directory of images
+ *
+ * The files are sorted by name and numbered. Worker threads claim the next
+ * file, read it and compute its SHA and resolution; the calling thread is
+ * the only writer and inserts the prepared images in order, one batch at a
+ * time. Workers never run more than IMPORT_WINDOW files ahead of the
+ * writer, which bounds the memory held by the images read in advance.
+ *
+ * @author Basile Thullen, Jeremy Hottinger
+ * @date 11 Jun 2016
+ */
+
+#include "pictDB.h"
+
+#include <dirent.h>     // for opendir
+#include <strings.h>    // for strcasecmp
+#include <pthread.h>
+
+// number of images inserted by a single do_insert_batch
+#define IMPORT_BATCH 64
+// maximal number of images read ahead of the writer
+#define IMPORT_WINDOW (4 * IMPORT_BATCH)
+
+/* An image of the directory and its progress through the import */
+struct import_item {
+    char* filename;
+    struct pict_insert image;
+    int ready; // read and prepared, or failed
+};
+
+/* State shared by the workers and the writer */
+struct import_state {
+    const char* dirname;
+    struct import_item* items;
+    size_t count;
+    size_t next;      // next item to claim by a worker
+    size_t committed; // items before this one are inserted
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+static int is_jpeg_name(const char* name);
+static int list_images(const char* dirname, struct import_item** items, size_t* count);
+static int name_cmp(const void* a, const void* b);
+static int read_image(const char* dirname, const char* filename, char** img_array, size_t* size);
+static void* import_worker(void* arg);
+static int commit_batch(struct pictdb_file* db_file, struct import_state* state, size_t first, size_t last);
+
+/**
+ * @brief tell whether a filename has a JPEG extension
+ */
+static int is_jpeg_name(const char* name)
+{
+    const char* dot = strrchr(name, '.');
+    return dot != NULL && (strcasecmp(dot, ".jpg") == 0 || strcasecmp(dot, ".jpeg") == 0);
+}
+
+/**
+ * @brief order import items by filename
+ */
+static int name_cmp(const void* a, const void* b)
+{
+    const struct import_item* ia = a;
+    const struct import_item* ib = b;
+    return strcmp(ia->filename, ib->filename);
+}
+
+/**
+ * @brief list the JPEG files of a directory, sorted by name
+ */
+static int list_images(const char* dirname, struct import_item** items, size_t* count)
+{
+    DIR* dir = opendir(dirname);
+    if(dir == NULL) {
+        return ERR_IO;
+    }
+
+    size_t capacity = 0;
+    *items = NULL;
+    *count = 0;
+
+    struct dirent* entry = NULL;
+    while((entry = readdir(dir)) != NULL) {
+        if(entry->d_name[0] == '.' || !is_jpeg_name(entry->d_name)) {
+            continue;
+        }
+        if(*count == capacity) {
+            capacity = capacity > 0 ? 2 * capacity : 64;
+            struct import_item* grown = realloc(*items, capacity * sizeof(struct import_item));
+            if(grown == NULL) {
+                closedir(dir);
+                return ERR_OUT_OF_MEMORY;
+            }
+            *items = grown;
+        }
+
+        struct import_item* item = &((*items)[*count]);
+        memset(item, 0, sizeof(struct import_item));
+        item->filename = strdup(entry->d_name);
+        if(item->filename == NULL) {
+            closedir(dir);
+            return ERR_OUT_OF_MEMORY;
+        }
+        item->image.img_id = item->filename;
+        (*count)++;
+    }
+    closedir(dir);
+
+    if(*count > 0) {
+        qsort(*items, *count, sizeof(struct import_item), name_cmp);
+        // the filenames moved: the ids must follow them
+        size_t k = 0;
+        for(k = 0; k < *count; k++) {
+            (*items)[k].image.img_id = (*items)[k].filename;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief read a whole file of the directory in memory
+ */
+static int read_image(const char* dirname, const char* filename, char** img_array, size_t* size)
+{
+    size_t path_len = strlen(dirname) + strlen(filename) + 2;
+    char* path = malloc(path_len);
+    if(path == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    snprintf(path, path_len, "%s/%s", dirname, filename);
+
+    FILE* fp = fopen(path, "rb");
+    free(path);
+    if(fp == NULL) {
+        return ERR_IO;
+    }
+
+    off_t end = -1;
+    if(fseeko(fp, 0, SEEK_END) == 0) {
+        end = ftello(fp);
+    }
+    if(end <= 0 || (uint64_t) end > UINT32_MAX || fseeko(fp, 0, SEEK_SET) != 0) {
+        fclose(fp);
+        return ERR_IO;
+    }
+
+    char* buffer = malloc(end);
+    if(buffer == NULL) {
+        fclose(fp);
+        return ERR_OUT_OF_MEMORY;
+    }
+    if(fread(buffer, end, 1, fp) != 1) {
+        free(buffer);
+        fclose(fp);
+        return ERR_IO;
+    }
+    fclose(fp);
+
+    *img_array = buffer;
+    *size = end;
+    return 0;
+}
+
+/**
+ * @brief read and prepare images until every file is claimed
+ */
+static void* import_worker(void* arg)
+{
+    struct import_state* state = arg;
+
+    for(;;) {
+        pthread_mutex_lock(&state->lock);
+        while(state->next < state->count && state->next >= state->committed + IMPORT_WINDOW) {
+            pthread_cond_wait(&state->changed, &state->lock);
+        }
+        if(state->next >= state->count) {
+            pthread_mutex_unlock(&state->lock);
+            return NULL;
+        }
+        struct import_item* item = &(state->items[state->next++]);
+        pthread_mutex_unlock(&state->lock);
+
+        char* img_array = NULL;
+        size_t size = 0;
+        int res = read_image(state->dirname, item->filename, &img_array, &size);
+        item->image.img_array = img_array;
+        item->image.img_size = size;
+        if(res == 0) {
+            res = prepare_insert(&(item->image));
+        }
+
+        pthread_mutex_lock(&state->lock);
+        item->image.result = res;
+        item->ready = 1;
+        pthread_cond_broadcast(&state->changed);
+        pthread_mutex_unlock(&state->lock);
+    }
+}
+
+/**
+ * @brief insert the prepared images of a range of items, report the
+ *        failures and release the images
+ *
+ * @return 0 if the batch was written, error code if the import must stop
+ */
+static int commit_batch(struct pictdb_file* db_file, struct import_state* state, size_t first, size_t last)
+{
+    struct pict_insert batch[IMPORT_BATCH];
+    size_t from[IMPORT_BATCH];
+    size_t n = 0;
+    size_t k = 0;
+
+    for(k = first; k < last; k++) {
+        struct import_item* item = &(state->items[k]);
+        if(item->image.result == 0) {
+            batch[n] = item->image;
+            from[n] = k;
+            n++;
+        }
+    }
+
+    int res = do_insert_batch(batch, n, db_file);
+    for(k = 0; k < n; k++) {
+        state->items[from[k]].image.result = batch[k].result;
+    }
+
+    for(k = first; k < last; k++) {
+        struct import_item* item = &(state->items[k]);
+        if(item->image.result != 0) {
+            fprintf(stderr, "%s: %s\n", item->filename, ERROR_MESSAGES[item->image.result]);
+        }
+        free((char*) item->image.img_array);
+        item->image.img_array = NULL;
+    }
+    return res;
+}
+
+/**
+ * @brief insert every JPEG image of a directory
+ *
+ * @param db_file file in which to insert the images
+ * @param dirname directory containing the images
+ * @param nb_threads number of threads preparing the images
+ */
+int do_import(struct pictdb_file* db_file, const char* dirname, unsigned int nb_threads)
+{
+    if(db_file == NULL || dirname == NULL || nb_threads == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct import_state state;
+    memset(&state, 0, sizeof(state));
+    state.dirname = dirname;
+
+    int res = list_images(dirname, &state.items, &state.count);
+    if(res != 0 || state.count == 0) {
+        size_t k = 0;
+        for(k = 0; k < state.count; k++) {
+            free(state.items[k].filename);
+        }
+        free(state.items);
+        return res;
+    }
+
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.changed, NULL);
+
+    pthread_t* threads = calloc(nb_threads, sizeof(pthread_t));
+    unsigned int started = 0;
+    if(threads != NULL) {
+        while(started < nb_threads && pthread_create(&threads[started], NULL, import_worker, &state) == 0) {
+            started++;
+        }
+    }
+    if(started == 0) {
+        // out of threads or of memory for their stacks
+        res = ERR_OUT_OF_MEMORY;
+    }
+
+    // insert the items in order, as soon as a whole batch is ready
+    size_t first = 0;
+    while(res == 0 && first < state.count) {
+        size_t last = first + IMPORT_BATCH < state.count ? first + IMPORT_BATCH : state.count;
+
+        pthread_mutex_lock(&state.lock);
+        size_t k = first;
+        while(k < last) {
+            if(state.items[k].ready) {
+                k++;
+            } else {
+                pthread_cond_wait(&state.changed, &state.lock);
+            }
+        }
+        pthread_mutex_unlock(&state.lock);
+
+        res = commit_batch(db_file, &state, first, last);
+
+        pthread_mutex_lock(&state.lock);
+        state.committed = last;
+        if(res != 0) {
+            // nothing left to claim, the workers stop
+            state.next = state.count;
+        }
+        pthread_cond_broadcast(&state.changed);
+        pthread_mutex_unlock(&state.lock);
+        first = last;
+    }
+
+    unsigned int t = 0;
+    for(t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+
+    size_t k = 0;
+    for(k = 0; k < state.count; k++) {
+        free((char*) state.items[k].image.img_array);
+        free(state.items[k].filename);
+    }
+    free(state.items);
+    pthread_cond_destroy(&state.changed);
+    pthread_mutex_destroy(&state.lock);
+    return res;
+}
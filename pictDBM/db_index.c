@@ -0,0 +1,569 @@
+/**
+ * @file db_index.c
+ * @brief open-addressing hash indexes over the metadata of a database
+ *
+ * A bucket holds the index of a metadata slot plus one, 0 meaning that the
+ * bucket is empty. Collisions are resolved by linear probing and removals
+ * shift the following entries back, so no tombstone is ever needed.
+ *
+ * The SHA index is a multimap: every valid slot is referenced, so all the
+ * slots sharing a content are found along the same probe sequence.
+ *
+ * Empty slots are tracked in a bitmap, one bit per slot, searched word by
+ * word from the lowest word that may still hold a free slot.
+ *
+ * The extents are reference counted in a table keyed by their offset,
+ * probed and shifted back the same way. No extent starts at offset 0,
+ * which marks the empty buckets.
+ *
+ * @author Basile Thullen, Jeremy Hottinger
+ * @date 2 Jun 2016
+ */
+
+#include "db_index.h"
+
+// minimal number of buckets of an index
+#define MIN_INDEX_SIZE 16
+// number of slots tracked by a word of the free slots bitmap
+#define SLOTS_PER_WORD 64
+
+typedef uint64_t (*key_hash)(const struct pict_metadata* metadata);
+
+static uint64_t id_hash(const struct pict_metadata* metadata);
+static uint64_t sha_hash(const struct pict_metadata* metadata);
+static uint64_t hash_sha(const unsigned char* SHA);
+static uint64_t hash_string(const char* str);
+static uint64_t hash_offset(uint64_t offset);
+static int free_slots_init(struct pictdb_file* db_file);
+static int ref_index_init(struct ref_index* index, uint32_t max_files);
+static size_t ref_index_find(const struct ref_index* index, uint64_t offset);
+static void ref_index_remove(struct ref_index* index, size_t i);
+static void ref_index_add(struct ref_index* index, uint64_t offset, uint32_t count);
+static void slot_refs_update(struct pictdb_file* db_file, uint32_t slot, int delta);
+static int slot_index_init(struct slot_index* index, uint32_t max_files);
+static void slot_index_add(struct slot_index* index, const struct pict_metadata* metadata, uint32_t slot, key_hash hash);
+static void slot_index_remove(struct slot_index* index, const struct pict_metadata* metadata, uint32_t slot, key_hash hash);
+
+/**
+ * @brief FNV-1a hash of a null terminated string
+ */
+static uint64_t hash_string(const char* str)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    while(*str != '\0') {
+        hash ^= (unsigned char) *str++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief hash of the picture id of a metadata
+ */
+static uint64_t id_hash(const struct pict_metadata* metadata)
+{
+    return hash_string(metadata->pict_id);
+}
+
+/**
+ * @brief hash of a SHA digest, its first bytes are already uniformly
+ *        distributed
+ */
+static uint64_t hash_sha(const unsigned char* SHA)
+{
+    uint64_t hash = 0;
+    memcpy(&hash, SHA, sizeof(hash));
+    return hash;
+}
+
+/**
+ * @brief hash of the content digest of a metadata
+ */
+static uint64_t sha_hash(const struct pict_metadata* metadata)
+{
+    return hash_sha(metadata->SHA);
+}
+
+/**
+ * @brief hash of an extent offset, the high bits of the product are
+ *        folded so that the mask sees every bit of the offset
+ */
+static uint64_t hash_offset(uint64_t offset)
+{
+    uint64_t hash = offset * 0x9E3779B97F4A7C15ULL;
+    return hash ^ (hash >> 32);
+}
+
+/**
+ * @brief allocate an empty index able to hold max_files slots with a load
+ *        factor of at most one half
+ *
+ * @param index index to initialize
+ * @param max_files maximal number of slots of the database
+ */
+static int slot_index_init(struct slot_index* index, uint32_t max_files)
+{
+    size_t size = MIN_INDEX_SIZE;
+    while(size < 2 * (size_t) max_files) {
+        size *= 2;
+    }
+
+    index->buckets = calloc(size, sizeof(uint32_t));
+    if(index->buckets == NULL) {
+        index->mask = 0;
+        return ERR_OUT_OF_MEMORY;
+    }
+    index->mask = size - 1;
+    return 0;
+}
+
+/**
+ * @brief allocate an empty reference table able to hold every extent of
+ *        max_files slots with a load factor of at most one half
+ */
+static int ref_index_init(struct ref_index* index, uint32_t max_files)
+{
+    size_t size = MIN_INDEX_SIZE;
+    while(size < 2 * NB_RES * (size_t) max_files) {
+        size *= 2;
+    }
+
+    index->offsets = calloc(size, sizeof(uint64_t));
+    index->counts = calloc(size, sizeof(uint32_t));
+    if(index->offsets == NULL || index->counts == NULL) {
+        free(index->offsets);
+        free(index->counts);
+        index->offsets = NULL;
+        index->counts = NULL;
+        index->mask = 0;
+        return ERR_OUT_OF_MEMORY;
+    }
+    index->mask = size - 1;
+    return 0;
+}
+
+/**
+ * @brief bucket of an extent, or the empty bucket ending its probe sequence
+ */
+static size_t ref_index_find(const struct ref_index* index, uint64_t offset)
+{
+    size_t i = hash_offset(offset) & index->mask;
+    while(index->offsets[i] != 0 && index->offsets[i] != offset) {
+        i = (i + 1) & index->mask;
+    }
+    return i;
+}
+
+/**
+ * @brief empty a bucket and shift back the entries of its probe sequence
+ */
+static void ref_index_remove(struct ref_index* index, size_t i)
+{
+    size_t j = i;
+    for(;;) {
+        j = (j + 1) & index->mask;
+        if(index->offsets[j] == 0) {
+            break;
+        }
+        size_t home = hash_offset(index->offsets[j]) & index->mask;
+        int stays = (i <= j) ? (home > i && home <= j) : (home > i || home <= j);
+        if(!stays) {
+            index->offsets[i] = index->offsets[j];
+            index->counts[i] = index->counts[j];
+            i = j;
+        }
+    }
+    index->offsets[i] = 0;
+    index->counts[i] = 0;
+}
+
+/**
+ * @brief add users to an extent, inserting it if needed
+ */
+static void ref_index_add(struct ref_index* index, uint64_t offset, uint32_t count)
+{
+    size_t i = ref_index_find(index, offset);
+    index->offsets[i] = offset;
+    index->counts[i] += count;
+}
+
+/**
+ * @brief count or uncount every extent of a slot
+ */
+static void slot_refs_update(struct pictdb_file* db_file, uint32_t slot, int delta)
+{
+    struct ref_index* index = &(db_file->extent_refs);
+    const struct pict_metadata* metadata = &(db_file->metadata[slot]);
+    int r = 0;
+    for(r = 0; r < NB_RES; r++) {
+        if(metadata->offset[r] == 0 || metadata->size[r] == 0) {
+            continue;
+        }
+        if(delta > 0) {
+            ref_index_add(index, metadata->offset[r], 1);
+        } else {
+            size_t i = ref_index_find(index, metadata->offset[r]);
+            if(index->offsets[i] != 0 && --(index->counts[i]) == 0) {
+                ref_index_remove(index, i);
+            }
+        }
+    }
+}
+
+/**
+ * @brief allocate the free slots bitmap with every slot marked as free,
+ *        the bits past max_files are left cleared
+ */
+static int free_slots_init(struct pictdb_file* db_file)
+{
+    uint32_t max_files = db_file->header.max_files;
+    size_t words = (max_files + SLOTS_PER_WORD - 1) / SLOTS_PER_WORD;
+
+    db_file->free_hint = 0;
+    db_file->free_slots = calloc(words > 0 ? words : 1, sizeof(uint64_t));
+    if(db_file->free_slots == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    size_t w = 0;
+    for(w = 0; w < words; w++) {
+        db_file->free_slots[w] = ~0ULL;
+    }
+    if(max_files % SLOTS_PER_WORD != 0) {
+        db_file->free_slots[words - 1] = (1ULL << (max_files % SLOTS_PER_WORD)) - 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief add a slot in the first empty bucket after its home bucket
+ */
+static void slot_index_add(struct slot_index* index, const struct pict_metadata* metadata, uint32_t slot, key_hash hash)
+{
+    size_t i = hash(&metadata[slot]) & index->mask;
+    while(index->buckets[i] != 0) {
+        i = (i + 1) & index->mask;
+    }
+    index->buckets[i] = slot + 1;
+}
+
+/**
+ * @brief remove a slot and shift back the entries of its probe sequence
+ */
+static void slot_index_remove(struct slot_index* index, const struct pict_metadata* metadata, uint32_t slot, key_hash hash)
+{
+    size_t i = hash(&metadata[slot]) & index->mask;
+    while(index->buckets[i] != slot + 1) {
+        if(index->buckets[i] == 0) {
+            // slot isn't indexed
+            return;
+        }
+        i = (i + 1) & index->mask;
+    }
+
+    size_t j = i;
+    for(;;) {
+        j = (j + 1) & index->mask;
+        if(index->buckets[j] == 0) {
+            break;
+        }
+        size_t home = hash(&metadata[index->buckets[j] - 1]) & index->mask;
+        // the entry at j can fill the hole at i only if its home bucket
+        // isn't cyclically between i (excluded) and j (included)
+        int stays = (i <= j) ? (home > i && home <= j) : (home > i || home <= j);
+        if(!stays) {
+            index->buckets[i] = index->buckets[j];
+            i = j;
+        }
+    }
+    index->buckets[i] = 0;
+}
+
+/**
+ * @brief build the indexes of a database from its metadata
+ *
+ * @param db_file database whose metadata are already in memory
+ */
+int index_build(struct pictdb_file* db_file)
+{
+    if(db_file == NULL || db_file->metadata == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    int res = slot_index_init(&(db_file->id_index), db_file->header.max_files);
+    if(res == 0) {
+        res = slot_index_init(&(db_file->sha_index), db_file->header.max_files);
+    }
+    if(res == 0) {
+        res = free_slots_init(db_file);
+    }
+    if(res == 0) {
+        res = ref_index_init(&(db_file->extent_refs), db_file->header.max_files);
+    }
+    if(res != 0) {
+        // leave the indexes not built, so that a later call retries and
+        // do_close frees nothing twice
+        index_free(db_file);
+        index_clear(db_file);
+        return res;
+    }
+
+    uint32_t i = 0;
+    for(i = 0; i < db_file->header.max_files; i++) {
+        if(db_file->metadata[i].is_valid == NON_EMPTY) {
+            index_add(db_file, i);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief mark the indexes of a database as not built yet
+ *
+ * @param db_file database whose indexes must be reset
+ */
+void index_clear(struct pictdb_file* db_file)
+{
+    if(db_file != NULL) {
+        db_file->id_index.buckets = NULL;
+        db_file->sha_index.buckets = NULL;
+        db_file->free_slots = NULL;
+        db_file->free_hint = 0;
+        db_file->extent_refs.offsets = NULL;
+        db_file->extent_refs.counts = NULL;
+    }
+}
+
+/**
+ * @brief build the indexes of a database if they aren't built yet
+ *
+ * @param db_file database whose indexes are needed
+ */
+int index_ensure(struct pictdb_file* db_file)
+{
+    if(db_file == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if(db_file->id_index.buckets != NULL) {
+        return 0;
+    }
+    return index_build(db_file);
+}
+
+/**
+ * @brief free the indexes of a database
+ *
+ * @param db_file database whose indexes must be freed
+ */
+void index_free(const struct pictdb_file* db_file)
+{
+    if(db_file != NULL) {
+        free(db_file->id_index.buckets);
+        free(db_file->sha_index.buckets);
+        free(db_file->free_slots);
+        free(db_file->extent_refs.offsets);
+        free(db_file->extent_refs.counts);
+    }
+}
+
+/**
+ * @brief find the slot of a valid image given its picture id
+ *
+ * Without the indexes, the metadata are scanned up to the first match.
+ *
+ * @param db_file database in which to search
+ * @param pict_id picture id to search for
+ */
+int index_find_id(const struct pictdb_file* db_file, const char* pict_id)
+{
+    if(db_file == NULL || pict_id == NULL) {
+        return -1;
+    }
+
+    if(db_file->id_index.buckets == NULL) {
+        uint32_t slot = 0;
+        for(slot = 0; slot < db_file->header.max_files; slot++) {
+            if(db_file->metadata[slot].is_valid == NON_EMPTY
+               && strcmp(db_file->metadata[slot].pict_id, pict_id) == 0) {
+                return slot;
+            }
+        }
+        return -1;
+    }
+
+    const struct slot_index* index = &(db_file->id_index);
+    size_t i = hash_string(pict_id) & index->mask;
+    while(index->buckets[i] != 0) {
+        uint32_t slot = index->buckets[i] - 1;
+        if(strcmp(db_file->metadata[slot].pict_id, pict_id) == 0) {
+            return slot;
+        }
+        i = (i + 1) & index->mask;
+    }
+    return -1;
+}
+
+/**
+ * @brief find a valid slot whose image has the given SHA
+ *
+ * @param db_file database in which to search
+ * @param SHA digest of the content to search for
+ */
+int index_find_sha(const struct pictdb_file* db_file, const unsigned char* SHA)
+{
+    long cursor = -1;
+    return index_next_sha(db_file, SHA, &cursor);
+}
+
+/**
+ * @brief iterate over all the valid slots sharing the given SHA
+ *
+ * @param db_file database in which to search
+ * @param SHA digest of the content to search for
+ * @param cursor position of the iteration, -1 before the first call
+ */
+int index_next_sha(const struct pictdb_file* db_file, const unsigned char* SHA, long* cursor)
+{
+    if(db_file == NULL || SHA == NULL || cursor == NULL || db_file->sha_index.buckets == NULL) {
+        return -1;
+    }
+
+    const struct slot_index* index = &(db_file->sha_index);
+    size_t i = (*cursor < 0) ? (hash_sha(SHA) & index->mask) : ((*cursor + 1) & index->mask);
+    while(index->buckets[i] != 0) {
+        uint32_t slot = index->buckets[i] - 1;
+        if(memcmp(db_file->metadata[slot].SHA, SHA, SHA256_DIGEST_LENGTH) == 0) {
+            *cursor = i;
+            return slot;
+        }
+        i = (i + 1) & index->mask;
+    }
+    *cursor = i;
+    return -1;
+}
+
+/**
+ * @brief find the first empty slot of the database
+ *
+ * @param db_file database in which to search
+ */
+int index_first_free(struct pictdb_file* db_file)
+{
+    if(db_file == NULL || db_file->free_slots == NULL) {
+        return -1;
+    }
+
+    size_t words = (db_file->header.max_files + SLOTS_PER_WORD - 1) / SLOTS_PER_WORD;
+    // every word skipped here is full and stays skipped until a slot is freed
+    while(db_file->free_hint < words && db_file->free_slots[db_file->free_hint] == 0) {
+        db_file->free_hint++;
+    }
+    if(db_file->free_hint >= words) {
+        return -1;
+    }
+
+    uint64_t word = db_file->free_slots[db_file->free_hint];
+    return db_file->free_hint * SLOTS_PER_WORD + __builtin_ctzll(word);
+}
+
+/**
+ * @brief number of valid images using an extent
+ *
+ * @param db_file database in which to search
+ * @param offset offset of the extent
+ */
+uint32_t index_extent_refs(const struct pictdb_file* db_file, uint64_t offset)
+{
+    if(db_file == NULL || db_file->extent_refs.offsets == NULL || offset == 0) {
+        return 0;
+    }
+    const struct ref_index* index = &(db_file->extent_refs);
+    return index->counts[ref_index_find(index, offset)];
+}
+
+/**
+ * @brief count one more image using an extent
+ *
+ * @param db_file database to update
+ * @param offset offset of the extent
+ */
+void index_extent_ref(struct pictdb_file* db_file, uint64_t offset)
+{
+    if(db_file != NULL && db_file->extent_refs.offsets != NULL && offset != 0) {
+        ref_index_add(&(db_file->extent_refs), offset, 1);
+    }
+}
+
+/**
+ * @brief count one image less using an extent
+ *
+ * @param db_file database to update
+ * @param offset offset of the extent
+ */
+void index_extent_unref(struct pictdb_file* db_file, uint64_t offset)
+{
+    if(db_file != NULL && db_file->extent_refs.offsets != NULL && offset != 0) {
+        struct ref_index* index = &(db_file->extent_refs);
+        size_t i = ref_index_find(index, offset);
+        if(index->offsets[i] != 0 && --(index->counts[i]) == 0) {
+            ref_index_remove(index, i);
+        }
+    }
+}
+
+/**
+ * @brief record that an extent moved to another offset, with its users
+ *
+ * @param db_file database to update
+ * @param from old offset of the extent
+ * @param to new offset of the extent
+ */
+void index_extent_move(struct pictdb_file* db_file, uint64_t from, uint64_t to)
+{
+    if(db_file == NULL || db_file->extent_refs.offsets == NULL || from == 0 || to == 0 || from == to) {
+        return;
+    }
+    struct ref_index* index = &(db_file->extent_refs);
+    size_t i = ref_index_find(index, from);
+    if(index->offsets[i] == 0) {
+        return;
+    }
+    uint32_t count = index->counts[i];
+    ref_index_remove(index, i);
+    ref_index_add(index, to, count);
+}
+
+/**
+ * @brief reference a freshly validated slot in the indexes
+ *
+ * @param db_file database to update
+ * @param slot index of the metadata to add
+ */
+void index_add(struct pictdb_file* db_file, uint32_t slot)
+{
+    if(db_file != NULL && db_file->id_index.buckets != NULL && slot < db_file->header.max_files) {
+        slot_index_add(&(db_file->id_index), db_file->metadata, slot, id_hash);
+        slot_index_add(&(db_file->sha_index), db_file->metadata, slot, sha_hash);
+        slot_refs_update(db_file, slot, 1);
+        db_file->free_slots[slot / SLOTS_PER_WORD] &= ~(1ULL << (slot % SLOTS_PER_WORD));
+    }
+}
+
+/**
+ * @brief remove a slot from the indexes
+ *
+ * @param db_file database to update
+ * @param slot index of the metadata to remove
+ */
+void index_remove(struct pictdb_file* db_file, uint32_t slot)
+{
+    if(db_file != NULL && db_file->id_index.buckets != NULL && slot < db_file->header.max_files) {
+        slot_index_remove(&(db_file->id_index), db_file->metadata, slot, id_hash);
+        slot_index_remove(&(db_file->sha_index), db_file->metadata, slot, sha_hash);
+        slot_refs_update(db_file, slot, -1);
+        db_file->free_slots[slot / SLOTS_PER_WORD] |= 1ULL << (slot % SLOTS_PER_WORD);
+        if(slot / SLOTS_PER_WORD < db_file->free_hint) {
+            db_file->free_hint = slot / SLOTS_PER_WORD;
+        }
+    }
+}
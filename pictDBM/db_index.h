@@ -0,0 +1,157 @@
+/**
+ * @file db_index.h
+ * @brief prototypes for the in-memory indexes of a pictdb_file
+ *
+ * The indexes are never stored on the disk: they are rebuilt from the
+ * metadata the first time a database needs them and kept up to date by
+ * insert and delete. Building them lazily keeps do_open from touching
+ * every page of a mapped metadata table.
+ *
+ * Reading or listing never builds them: a read looks its image up with a
+ * scan that stops at the first match. Insert and delete still build them
+ * and so walk all max_files slots once, since they need the id and SHA
+ * of every image and the count of references to each extent. A
+ * long-lived process pays that once; a single insert or delete from the
+ * command line pays it on every run.
+ *
+ * @author Basile Thullen, Jeremy Hottinger
+ * @date 2 Jun 2016
+ */
+
+#ifndef DB_INDEX_H
+#define DB_INDEX_H
+
+#include "pictDB.h"
+
+/**
+ * @brief build the indexes of a database from its metadata
+ *
+ * @param db_file database whose metadata are already in memory
+ *
+ * @return 0 if successful, error code if not
+ */
+int index_build(struct pictdb_file* db_file);
+
+/**
+ * @brief mark the indexes of a database as not built yet
+ *
+ * @param db_file database whose indexes must be reset
+ */
+void index_clear(struct pictdb_file* db_file);
+
+/**
+ * @brief build the indexes of a database if they aren't built yet
+ *
+ * @param db_file database whose indexes are needed
+ *
+ * @return 0 if successful, error code if not
+ */
+int index_ensure(struct pictdb_file* db_file);
+
+/**
+ * @brief free the indexes of a database
+ *
+ * @param db_file database whose indexes must be freed
+ */
+void index_free(const struct pictdb_file* db_file);
+
+/**
+ * @brief find the slot of a valid image given its picture id
+ *
+ * Uses the id index when it is built and scans the metadata otherwise.
+ *
+ * @param db_file database in which to search
+ * @param pict_id picture id to search for
+ *
+ * @return the index of the image in the metadata, -1 if not found
+ */
+int index_find_id(const struct pictdb_file* db_file, const char* pict_id);
+
+/**
+ * @brief find a valid slot whose image has the given SHA
+ *
+ * @param db_file database in which to search
+ * @param SHA digest of the content to search for
+ *
+ * @return the index of an image with this content, -1 if not found
+ */
+int index_find_sha(const struct pictdb_file* db_file, const unsigned char* SHA);
+
+/**
+ * @brief iterate over all the valid slots sharing the given SHA
+ *
+ * @param db_file database in which to search
+ * @param SHA digest of the content to search for
+ * @param cursor position of the iteration, must be set to -1 before the
+ *        first call
+ *
+ * @return the index of the next image with this content, -1 at the end
+ */
+int index_next_sha(const struct pictdb_file* db_file, const unsigned char* SHA, long* cursor);
+
+/**
+ * @brief find the first empty slot of the database
+ *
+ * @param db_file database in which to search
+ *
+ * @return the index of an empty metadata, -1 if the database is full
+ */
+int index_first_free(struct pictdb_file* db_file);
+
+/**
+ * @brief number of valid images using an extent
+ *
+ * @param db_file database in which to search
+ * @param offset offset of the extent
+ *
+ * @return the reference count of the extent, 0 if nothing uses it
+ */
+uint32_t index_extent_refs(const struct pictdb_file* db_file, uint64_t offset);
+
+/**
+ * @brief count one more image using an extent, for the extents added to a
+ *        slot already indexed
+ *
+ * @param db_file database to update
+ * @param offset offset of the extent
+ */
+void index_extent_ref(struct pictdb_file* db_file, uint64_t offset);
+
+/**
+ * @brief count one image less using an extent, for the extents dropped
+ *        from a slot that stays indexed
+ *
+ * @param db_file database to update
+ * @param offset offset of the extent
+ */
+void index_extent_unref(struct pictdb_file* db_file, uint64_t offset);
+
+/**
+ * @brief record that an extent moved to another offset, with its users
+ *
+ * @param db_file database to update
+ * @param from old offset of the extent
+ * @param to new offset of the extent
+ */
+void index_extent_move(struct pictdb_file* db_file, uint64_t from, uint64_t to);
+
+/**
+ * @brief reference a freshly validated slot in the indexes and mark it
+ *        as used
+ *
+ * @param db_file database to update
+ * @param slot index of the metadata to add
+ */
+void index_add(struct pictdb_file* db_file, uint32_t slot);
+
+/**
+ * @brief remove a slot from the indexes and mark it as free, must be
+ *        called before the metadata of the slot is modified. The extents
+ *        whose reference count drops to 0 can be reclaimed
+ *
+ * @param db_file database to update
+ * @param slot index of the metadata to remove
+ */
+void index_remove(struct pictdb_file* db_file, uint32_t slot);
+
+#endif
@@ -1,6 +1,6 @@
 /**
  * @file db_insert.c
- * @brief implementation of a function that insert an image in the database
+ * @brief implementation of the functions that insert images in the database
  *
  * @author Basile Thullen - Jeremy Hottinger
  * @date 10 May 2016
@@ -10,105 +10,276 @@
 #include <openssl/sha.h>
 #include "image_content.h"
 #include "dedup.h"
+#include "db_index.h"
 
-int update_file(struct pictdb_file* db_file, size_t index);
+#include <limits.h>     // for IOV_MAX
+#include <sys/uio.h>    // for pwritev
 
+static int prepare_slot(struct pictdb_file* db_file, struct pict_insert* image, uint64_t* write_offset, uint32_t* slot, int* new_content);
+static int write_blobs(int fd, struct iovec* iov, size_t count, uint64_t offset);
+static int write_slots(struct pictdb_file* db_file, uint32_t* slots, size_t count);
+static int slot_cmp(const void* a, const void* b);
+static int insert_batch_locked(struct pict_insert* images, size_t count, struct pictdb_file* db_file);
+
+/**
+ * @brief insert an image in the database
+ *
+ * @param img_array the array containing the image to insert
+ * @param img_size the size of the image
+ * @param img_id new id for image
+ * @param db_file file in which to insert the image
+ */
 int do_insert(const char* img_array, size_t img_size, const char* img_id, struct pictdb_file* db_file)
 {
+    struct pict_insert image;
+    image.img_array = img_array;
+    image.img_size = img_size;
+    image.img_id = img_id;
+    image.prepared = 0;
+    image.result = 0;
+
+    int res = do_insert_batch(&image, 1, db_file);
+    return res != 0 ? res : image.result;
+}
 
-    if(db_file == NULL || img_id == NULL || img_id[0] == '\0' || img_array == NULL || img_size <= 0) {
+/**
+ * @brief compute the SHA and the resolution of an image to insert
+ *
+ * @param image image to prepare
+ */
+int prepare_insert(struct pict_insert* image)
+{
+    if(image == NULL || image->img_array == NULL || image->img_size == 0) {
         return ERR_INVALID_ARGUMENT;
     }
 
-    // database is full
-    if(db_file->header.num_files >= db_file->header.max_files) {
-        return ERR_FULL_DATABASE;
+    (void)SHA256((unsigned char *)image->img_array, image->img_size, image->SHA);
+    int res = get_resolution(&(image->res_orig[1]), &(image->res_orig[0]), image->img_array, image->img_size);
+    if(res != 0) {
+        return res;
     }
+    image->prepared = 1;
+    return 0;
+}
 
-    int i = 0;
-    while(i <= db_file->header.max_files && db_file->metadata[i].is_valid == NON_EMPTY) {
-        i++;
+/**
+ * @brief fill a free slot for an image of a batch and index it, the slot
+ *        stays invalid on the disk until the batch is written
+ *
+ * @param write_offset offset at which the next new content will be written
+ * @param slot return argument, slot of the image
+ * @param new_content return argument, 1 if the bytes must be written
+ */
+static int prepare_slot(struct pictdb_file* db_file, struct pict_insert* image, uint64_t* write_offset, uint32_t* slot, int* new_content)
+{
+    if(image->img_id == NULL || image->img_id[0] == '\0' || image->img_array == NULL || image->img_size == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if(strlen(image->img_id) > MAX_PIC_ID) {
+        return ERR_INVALID_PICID;
+    }
+    if(!image->prepared) {
+        int res = prepare_insert(image);
+        if(res != 0) {
+            return res;
+        }
     }
 
-    if(i > db_file->header.max_files) {
+    // take the first free slot, the slots of the batch are already taken
+    int i = index_first_free(db_file);
+    if(i < 0) {
         return ERR_FULL_DATABASE;
     }
 
-    // we found a place at index i
-    // compute sha
-    (void)SHA256((unsigned char *)img_array, img_size, db_file->metadata[i].SHA);
-    strncpy(db_file->metadata[i].pict_id, img_id, strlen(img_id));
-    db_file->metadata[i].pict_id[strlen(img_id)] = '\0';
-    db_file->metadata[i].size[RES_ORIG] = img_size;
-
-    // check for dedup
-    int dedup_res = do_name_and_content_dedup(db_file, i);
-    if(dedup_res != 0) {
-        return dedup_res;
-    }
+    struct pict_metadata* metadata = &(db_file->metadata[i]);
+    memcpy(metadata->SHA, image->SHA, SHA256_DIGEST_LENGTH);
+    strncpy(metadata->pict_id, image->img_id, MAX_PIC_ID);
+    metadata->pict_id[MAX_PIC_ID] = '\0';
+    metadata->size[RES_ORIG] = image->img_size;
 
-    // an image with the same SHA was found by dedup
-    if(db_file->metadata[i].offset[RES_ORIG] != 0) {
-        db_file->metadata[i].is_valid = NON_EMPTY;
-        int res = update_file(db_file, i);
+    // check for dedup, also against the images earlier in the batch
+    int res = do_name_and_content_dedup(db_file, i);
+    if(res != 0) {
         return res;
     }
 
-    if(fseek(db_file->fpdb, 0, SEEK_END) != 0) {
-        return ERR_IO;
+    *new_content = metadata->offset[RES_ORIG] == 0;
+    if(*new_content) {
+        int a = 0;
+        for(a = 0; a < NB_RES; a++) {
+            metadata->offset[a] = 0;
+            metadata->size[a] = 0;
+        }
+        metadata->size[RES_ORIG] = image->img_size;
+        metadata->res_orig[0] = image->res_orig[0];
+        metadata->res_orig[1] = image->res_orig[1];
+        metadata->offset[RES_ORIG] = *write_offset;
+        *write_offset += image->img_size;
     }
 
-    long offset = ftell(db_file->fpdb);
+    index_add(db_file, i);
+    *slot = i;
+    return 0;
+}
 
-    if(fwrite(img_array, img_size, 1, db_file->fpdb) != 1) {
-        return ERR_IO;
-    }
+/**
+ * @brief write buffers at an offset with as few pwritev calls as possible
+ */
+static int write_blobs(int fd, struct iovec* iov, size_t count, uint64_t offset)
+{
+    size_t k = 0;
+    while(k < count) {
+        int n = count - k < IOV_MAX ? (int) (count - k) : IOV_MAX;
+        ssize_t written = pwritev(fd, &iov[k], n, (off_t) offset);
+        if(written <= 0) {
+            return ERR_IO;
+        }
+        offset += written;
 
-    int a = 0;
-    for(a = 0; a<NB_RES; a++) {
-        if(a != RES_ORIG) {
-            db_file->metadata[i].offset[a] = 0;
-            db_file->metadata[i].size[a] = 0;
+        // skip the buffers fully written, resume inside the last one
+        while(k < count && (size_t) written >= iov[k].iov_len) {
+            written -= iov[k].iov_len;
+            k++;
+        }
+        if(k < count) {
+            iov[k].iov_base = (char*) iov[k].iov_base + written;
+            iov[k].iov_len -= written;
         }
     }
+    return 0;
+}
 
-    db_file->metadata[i].offset[RES_ORIG] = (uint32_t) offset;
-    db_file->metadata[i].is_valid = NON_EMPTY;
+/**
+ * @brief order slots by index
+ */
+static int slot_cmp(const void* a, const void* b)
+{
+    uint32_t sa = *(const uint32_t*) a;
+    uint32_t sb = *(const uint32_t*) b;
+    return (sa > sb) - (sa < sb);
+}
 
-    int res = get_resolution(&(db_file->metadata[i].res_orig[1]), &(db_file->metadata[i].res_orig[0]), img_array, img_size);
-    if(res != 0) {
-        db_file->metadata[i].is_valid = EMPTY;
-        return res;
+/**
+ * @brief write the metadata of the given slots, one write per run of
+ *        consecutive slots
+ */
+static int write_slots(struct pictdb_file* db_file, uint32_t* slots, size_t count)
+{
+    qsort(slots, count, sizeof(uint32_t), slot_cmp);
+
+    size_t first = 0;
+    while(first < count) {
+        size_t last = first + 1;
+        while(last < count && slots[last] == slots[last - 1] + 1) {
+            last++;
+        }
+        int res = write_metadata_run(db_file, slots[first], last - first);
+        if(res != 0) {
+            return res;
+        }
+        first = last;
     }
+    return 0;
+}
 
-    res = update_file(db_file, i);
+/**
+ * @brief insert several images in the database at once
+ *
+ * @param images images to insert, their result field is set
+ * @param count number of images
+ * @param db_file file in which to insert the images
+ */
+int do_insert_batch(struct pict_insert* images, size_t count, struct pictdb_file* db_file)
+{
+    if(db_file == NULL || (images == NULL && count > 0)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if(count == 0) {
+        return 0;
+    }
 
+    db_lock_write(db_file);
+    int res = insert_batch_locked(images, count, db_file);
+    db_unlock(db_file);
     return res;
 }
 
-int update_file(struct pictdb_file* db_file, size_t index)
+/**
+ * @brief insert several images in the database at once, the caller holds
+ *        its write lock
+ */
+static int insert_batch_locked(struct pict_insert* images, size_t count, struct pictdb_file* db_file)
 {
+    int res = index_ensure(db_file);
+    if(res != 0) {
+        return res;
+    }
 
-    db_file->header.num_files ++;
-    db_file->header.db_version ++;
+    // the new contents are laid out from the current end of the file
+    uint64_t end = 0;
+    res = get_file_end(db_file, &end);
+    if(res != 0) {
+        return res;
+    }
 
-    if(fseek(db_file->fpdb, 0, SEEK_SET) != 0) {
-        db_file->metadata[index].is_valid = EMPTY;
-        return ERR_IO;
+    uint32_t* slots = calloc(count, sizeof(uint32_t));
+    struct iovec* iov = calloc(count, sizeof(struct iovec));
+    if(slots == NULL || iov == NULL) {
+        free(slots);
+        free(iov);
+        return ERR_OUT_OF_MEMORY;
     }
-    if(fwrite(&(db_file->header), sizeof(struct pictdb_header), 1, db_file->fpdb) != 1) {
-        db_file->metadata[index].is_valid = EMPTY;
-        return ERR_IO;
+
+    size_t nb_slots = 0;
+    size_t nb_blobs = 0;
+    uint64_t write_offset = end;
+    size_t k = 0;
+    for(k = 0; k < count; k++) {
+        int new_content = 0;
+        images[k].result = prepare_slot(db_file, &images[k], &write_offset, &slots[nb_slots], &new_content);
+        if(images[k].result == 0) {
+            nb_slots++;
+            if(new_content) {
+                iov[nb_blobs].iov_base = (void*) images[k].img_array;
+                iov[nb_blobs].iov_len = images[k].img_size;
+                nb_blobs++;
+            }
+        }
     }
 
-    if(fseek(db_file->fpdb, sizeof(struct pictdb_header) + index*sizeof(struct pict_metadata), SEEK_SET)) {
-        db_file->metadata[index].is_valid = EMPTY;
-        return ERR_IO;
+    // the bytes first, then the metadata making them reachable
+    res = write_blobs(fileno(db_file->fpdb), iov, nb_blobs, end);
+    free(iov);
+
+    if(res == 0 && nb_slots > 0) {
+        for(k = 0; k < nb_slots; k++) {
+            db_file->metadata[slots[k]].is_valid = NON_EMPTY;
+        }
+        db_file->header.num_files += nb_slots;
+        db_file->header.db_version++;
+
+        res = write_slots(db_file, slots, nb_slots);
+        if(res == 0) {
+            res = write_header(db_file);
+        }
+        if(res != 0) {
+            db_file->header.num_files -= nb_slots;
+        }
     }
-    if(fwrite(&(db_file->metadata[index]), sizeof(struct pict_metadata), 1, db_file->fpdb) != 1) {
-        db_file->metadata[index].is_valid = EMPTY;
-        return ERR_IO;
+
+    // undo the whole batch
+    if(res != 0) {
+        for(k = 0; k < nb_slots; k++) {
+            index_remove(db_file, slots[k]);
+            db_file->metadata[slots[k]].is_valid = EMPTY;
+        }
+        for(k = 0; k < count; k++) {
+            if(images[k].result == 0) {
+                images[k].result = res;
+            }
+        }
     }
 
-    return 0;
+    free(slots);
+    return res;
 }
@@ -9,12 +9,13 @@
 #include "pictDB.h"
 #include <json-c/json.h>
 
+static char* list_images(const struct pictdb_file* db_file, do_list_mode mode);
+
 /**
- * @brief List the images contained in a pictdb_file
- *
- * @param db_file file to list the images from
+ * @brief List the images contained in a pictdb_file, the caller holds its
+ *        lock
  */
-char* do_list(const struct pictdb_file* db_file, do_list_mode mode)
+static char* list_images(const struct pictdb_file* db_file, do_list_mode mode)
 {
     // Check for good parameter
     if(db_file != NULL) {
@@ -82,3 +83,19 @@ char* do_list(const struct pictdb_file* db_file, do_list_mode mode)
     }
     return NULL;
 }
+
+/**
+ * @brief List the images contained in a pictdb_file
+ *
+ * @param db_file file to list the images from
+ */
+char* do_list(struct pictdb_file* db_file, do_list_mode mode)
+{
+    if(db_file == NULL) {
+        return NULL;
+    }
+    db_lock_scan(db_file);
+    char* list = list_images(db_file, mode);
+    db_unlock(db_file);
+    return list;
+}
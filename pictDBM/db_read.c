@@ -8,6 +8,39 @@
 
 #include "pictDB.h"
 #include "image_content.h"
+#include "db_index.h"
+
+static int resize_unlocked(struct pictdb_file* db_file, size_t image_id);
+
+/**
+ * @brief generate the missing resized images of an image without holding
+ *        the lock while vips runs
+ *
+ * Called with the read lock held, returns with it released: the snapshot
+ * is taken under the read lock, the images are resized without it and
+ * committed under the write lock, where a job made stale meanwhile is
+ * dropped.
+ */
+static int resize_unlocked(struct pictdb_file* db_file, size_t image_id)
+{
+    // the other resolution costs little more once the original is
+    // decoded: generate both
+    const int wanted[NB_RES] = { 1, 1, 0 };
+    struct resize_job job;
+    int res = resize_job_init(&job, db_file, image_id, wanted);
+    db_unlock(db_file);
+
+    if(res == 0) {
+        res = resize_job_run(&job, db_file);
+    }
+    if(res == 0) {
+        db_lock_write(db_file);
+        res = resize_job_commit(&job, db_file);
+        db_unlock(db_file);
+    }
+    resize_job_free(&job);
+    return res;
+}
 
 /**
  * @brief reads an image from the database
@@ -25,51 +58,54 @@ int do_read(const char* img_id, int res_code, char** img_array, uint32_t* size,
         return ERR_INVALID_ARGUMENT;
     }
 
-    int i = 0;
-    // get the index of the image with img_id
-    while((strcmp(db_file->metadata[i].pict_id, img_id) != 0 || db_file->metadata[i].is_valid == EMPTY) && i <= db_file->header.max_files) {
-        i++;
-    }
+    int attempt = 0;
+    for(attempt = 0; ; attempt++) {
+        int res = 0;
+        db_lock_scan(db_file);
 
-    if(i == db_file->header.max_files) {
-        // image doesn't exists in database
-        return ERR_FILE_NOT_FOUND;
-    }
-
-    // check if image at corresponding resolution exists
-    if(db_file->metadata[i].offset[res_code] == 0 || db_file->metadata[i].size[res_code] == 0) {
+        // get the index of the image with img_id, through the index if
+        // a long-lived caller built it, by a scan otherwise
+        int i = index_find_id(db_file, img_id);
 
-        if(res_code == RES_ORIG) {
+        if(i < 0) {
+            // image doesn't exists in database
+            db_unlock(db_file);
             return ERR_FILE_NOT_FOUND;
         }
 
-        // resize original to the resolution
-        int res = lazily_resize(res_code, db_file, i);
-        if(res != 0) {
-            return res;
-        }
-    }
+        const struct pict_metadata* metadata = &(db_file->metadata[i]);
+        if(metadata->offset[res_code] != 0 && metadata->size[res_code] != 0) {
+            // allocate memory to receive the image from the file
+            uint32_t img_size = metadata->size[res_code];
+            char* img = calloc(img_size, sizeof(char));
+            if(img == NULL) {
+                db_unlock(db_file);
+                return ERR_OUT_OF_MEMORY;
+            }
 
-    // at this point we know that the image at correspondign resolution exists
+            res = read_data(db_file, img, img_size, metadata->offset[res_code]);
+            db_unlock(db_file);
+            if(res != 0) {
+                free(img);
+                return res;
+            }
 
-    if(fseek(db_file->fpdb, db_file->metadata[i].offset[res_code], SEEK_SET) != 0) {
-        return ERR_IO;
-    }
+            // set return arguments
+            *img_array = img;
+            *size = img_size;
+            return 0;
+        }
 
-    // allocate memory to receive the image from the file
-    char* img = calloc(db_file->metadata[i].size[res_code], sizeof(char));
-    if(img == NULL) {
-        return ERR_OUT_OF_MEMORY;
-    }
+        // a resized image dropped by a concurrent writer is made again,
+        // once
+        if(res_code == RES_ORIG || attempt == 2) {
+            db_unlock(db_file);
+            return ERR_FILE_NOT_FOUND;
+        }
 
-    if(fread(img, db_file->metadata[i].size[res_code], 1, db_file->fpdb) != 1) {
-        free(img);
-        return ERR_IO;
+        res = resize_unlocked(db_file, i);
+        if(res != 0) {
+            return res;
+        }
     }
-
-    // set return arguments
-    *img_array = img;
-    *size = db_file->metadata[i].size[res_code];
-    return 0;
-
 }
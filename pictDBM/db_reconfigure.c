@@ -0,0 +1,112 @@
+/**
+ * @file db_reconfigure.c
+ * @brief pictDB library: change of the resized resolutions of a database
+ *
+ * The resized images of a resolution whose box changes are dropped: their
+ * extents are uncounted, and the ones no image uses anymore become dead
+ * bytes and are punched once the metadata no longer reference them. The
+ * images are then resized again at the new resolution by a pool of
+ * workers, as warm does, once the write lock is released.
+ *
+ * @author Basile Thullen, Jeremy Hottinger
+ * @date 14 Jun 2016
+ */
+
+#include "pictDB.h"
+#include "db_index.h"
+#include "db_extent.h"
+
+/**
+ * @brief change the resized resolutions of a database and resize its
+ *        images again
+ *
+ * @param db_file opened database to reconfigure
+ * @param res_resized new thumbnail and small resolutions, as in the header
+ * @param nb_threads number of threads resizing the images
+ */
+int do_reconfigure(struct pictdb_file* db_file, const uint16_t res_resized[2 * (NB_RES - 1)], unsigned int nb_threads)
+{
+    if(db_file == NULL || res_resized == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    db_lock_write(db_file);
+    int changed[RES_ORIG];
+    int nb_changed = 0;
+    int r = 0;
+    for(r = 0; r < RES_ORIG; r++) {
+        changed[r] = res_resized[2*r] != db_file->header.res_resized[2*r]
+                     || res_resized[(2*r)+1] != db_file->header.res_resized[(2*r)+1];
+        nb_changed += changed[r];
+    }
+    if(nb_changed == 0) {
+        db_unlock(db_file);
+        return 0;
+    }
+
+    int res = index_ensure(db_file);
+    if(res != 0) {
+        db_unlock(db_file);
+        return res;
+    }
+
+    uint32_t max_files = db_file->header.max_files;
+    struct extent_list dead = { NULL, 0 };
+    if(max_files > 0) {
+        dead.extents = calloc((size_t) RES_ORIG * max_files, sizeof(struct extent));
+        if(dead.extents == NULL) {
+            db_unlock(db_file);
+            return ERR_OUT_OF_MEMORY;
+        }
+    }
+
+    // drop the resized images of the changed resolutions
+    uint32_t i = 0;
+    for(i = 0; i < max_files; i++) {
+        struct pict_metadata* metadata = &(db_file->metadata[i]);
+        if(metadata->is_valid != NON_EMPTY) {
+            continue;
+        }
+        for(r = 0; r < RES_ORIG; r++) {
+            if(!changed[r] || metadata->offset[r] == 0 || metadata->size[r] == 0) {
+                continue;
+            }
+            index_extent_unref(db_file, metadata->offset[r]);
+            // images sharing the extent release it with the last of them
+            if(index_extent_refs(db_file, metadata->offset[r]) == 0) {
+                dead.extents[dead.count].offset = metadata->offset[r];
+                dead.extents[dead.count].size = metadata->size[r];
+                dead.extents[dead.count].slot = i;
+                dead.count++;
+                db_file->header.dead_bytes += metadata->size[r];
+            }
+            metadata->offset[r] = 0;
+            metadata->size[r] = 0;
+        }
+    }
+
+    // the metadata go first: a valid entry never points to an image of
+    // the wrong size
+    memcpy(db_file->header.res_resized, res_resized, sizeof(db_file->header.res_resized));
+    ++(db_file->header.db_version);
+    res = write_metadata_run(db_file, 0, max_files);
+    if(res == 0) {
+        res = write_header(db_file);
+    }
+
+    // reclaim right away the extents no image uses anymore
+    if(res == 0 && dead.count > 0) {
+        res = sync_file(db_file);
+        size_t k = 0;
+        for(k = 0; res == 0 && k < dead.count; k++) {
+            res = extent_punch(fileno(db_file->fpdb), dead.extents[k].offset, dead.extents[k].size);
+        }
+    }
+    extent_list_free(&dead);
+    db_unlock(db_file);
+    if(res != 0) {
+        return res;
+    }
+
+    return do_warm(db_file, nb_changed == RES_ORIG ? -1 : (changed[RES_THUMB] ? RES_THUMB : RES_SMALL), nb_threads);
+}
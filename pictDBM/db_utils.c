@@ -7,11 +7,68 @@
  */
 
 #include "pictDB.h"
+#include "db_index.h"
 
 #include <stdint.h>         // for uint8_t
 #include <stdio.h>          // for sprintf
 #include <openssl/sha.h>    // for SHA256_DIGEST_LENGTH
 #include <inttypes.h>
+#include <sys/mman.h>       // for mmap
+#include <sys/stat.h>       // for fstat
+#include <unistd.h>         // for fsync, pread, pwrite
+
+static int pread_full(int fd, void* buffer, size_t size, uint64_t offset);
+static int pwrite_full(int fd, const void* buffer, size_t size, uint64_t offset);
+static void init_lock(struct pictdb_file* db_file);
+
+/**
+ * @brief Read exactly size bytes at an offset, without moving the file
+ *        position
+ */
+static int pread_full(int fd, void* buffer, size_t size, uint64_t offset)
+{
+    size_t done = 0;
+    while(done < size) {
+        ssize_t got = pread(fd, (char*) buffer + done, size - done, (off_t) (offset + done));
+        if(got <= 0) {
+            return ERR_IO;
+        }
+        done += got;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write exactly size bytes at an offset, without moving the file
+ *        position
+ */
+static int pwrite_full(int fd, const void* buffer, size_t size, uint64_t offset)
+{
+    size_t done = 0;
+    while(done < size) {
+        ssize_t written = pwrite(fd, (const char*) buffer + done, size - done, (off_t) (offset + done));
+        if(written <= 0) {
+            return ERR_IO;
+        }
+        done += written;
+    }
+    return 0;
+}
+
+/**
+ * @brief Initialize the lock of a database file, a waiting writer goes
+ *        before new readers so that a stream of reads can't starve it
+ */
+static void init_lock(struct pictdb_file* db_file)
+{
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&(db_file->lock), &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
 
 /**
  * @brief Human-readable SHA
@@ -44,6 +101,7 @@ void print_header(const struct pictdb_header* header)
         printf("VERSION: %" PRIu32 "\n", header->db_version);
         printf("IMAGE COUNT: %" PRIu32 "\tMAX IMAGES: %" PRIu32 "\n", header->num_files, header->max_files);
         printf("THUMBNAIL: %" PRIu16 " x %" PRIu16 "\t\tSMALL: %" PRIu16 " x %" PRIu16"\n", header->res_resized[0], header->res_resized[1], header->res_resized[2], header->res_resized[3]);
+        printf("DEAD BYTES: %" PRIu64 "\tGC THRESHOLD: %" PRIu32 "%%\n", header->dead_bytes, header->gc_threshold);
         printf("***********DATABASE HEADER END***********\n");
         printf("*****************************************\n");
     }
@@ -73,11 +131,40 @@ print_metadata (const struct pict_metadata* metadata)
     }
 }
 
+/**
+ * @brief Map the header and the metadata of an opened database
+ *
+ * @param db_file Pictdb_file whose header has already been read
+ * @param writable Whether the mapping can be modified
+ */
+static int map_metadata(struct pictdb_file* db_file, int writable)
+{
+    size_t map_size = sizeof(struct pictdb_header) + db_file->header.max_files * sizeof(struct pict_metadata);
+
+    // touching a page past the end of the file would raise SIGBUS
+    struct stat st;
+    if(fstat(fileno(db_file->fpdb), &st) != 0 || (size_t) st.st_size < map_size) {
+        return ERR_IO;
+    }
+
+    int prot = writable ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    void* map = mmap(NULL, map_size, prot, MAP_SHARED, fileno(db_file->fpdb), 0);
+    if(map == MAP_FAILED) {
+        return ERR_IO;
+    }
+
+    db_file->map = map;
+    db_file->map_size = map_size;
+    db_file->metadata = (struct pict_metadata*) ((char*) map + sizeof(struct pictdb_header));
+    return 0;
+}
+
 /**
  * @brief Open a pictdb_file in a certain mode
  *
  * @param filename Filename of the database
- * @param mode Opening mode of the file
+ * @param mode Opening mode of the file, as for fopen, plus MAP_MODE to map
+ *        the metadata instead of reading them
  * @param db_file Pictdb_file in which the opened image will be stored
  */
 int do_open(const char* filename, const char* mode, struct pictdb_file* db_file)
@@ -88,31 +175,61 @@ int do_open(const char* filename, const char* mode, struct pictdb_file* db_file)
         return ERR_INVALID_ARGUMENT;
     }
 
+    // Split the MAP_MODE flag from the fopen mode
+    char file_mode[MAX_MODE_LENGTH + 1];
+    size_t mode_len = 0;
+    int mapped = 0;
+    for(; *mode != '\0'; mode++) {
+        if(*mode == MAP_MODE) {
+            mapped = 1;
+        } else if(mode_len < MAX_MODE_LENGTH) {
+            file_mode[mode_len++] = *mode;
+        }
+    }
+    file_mode[mode_len] = '\0';
+
+    db_file->map = NULL;
+    db_file->map_size = 0;
+    index_clear(db_file);
+
     // Open and check if the opening worked
-    db_file->fpdb = fopen(filename, mode);
+    db_file->fpdb = fopen(filename, file_mode);
     if(db_file->fpdb == NULL) {
         return ERR_IO;
     }
 
     // Read the header
-    fseek(db_file->fpdb, 0L, SEEK_SET);
-    int header_count = fread(&(db_file->header), sizeof(struct pictdb_header), 1, db_file->fpdb);
-    if(header_count != 1) {
+    int fd = fileno(db_file->fpdb);
+    if(pread_full(fd, &(db_file->header), sizeof(struct pictdb_header), 0) != 0) {
+        fclose(db_file->fpdb);
         return ERR_IO;
     }
 
+    // Map the metadata, the pages are only read when they are touched
+    if(mapped) {
+        int writable = strpbrk(file_mode, "+wa") != NULL;
+        int res = map_metadata(db_file, writable);
+        if(res != 0) {
+            fclose(db_file->fpdb);
+            return res;
+        }
+        init_lock(db_file);
+        return 0;
+    }
+
     // Read the metadata
-    fseek(db_file->fpdb, sizeof(struct pictdb_header), SEEK_SET);
     db_file->metadata = calloc(db_file->header.max_files, sizeof(struct pict_metadata));
     if(db_file->metadata == NULL) {
+        fclose(db_file->fpdb);
         return ERR_OUT_OF_MEMORY;
     }
-    int metadata_count = fread(db_file->metadata, sizeof(struct pict_metadata), db_file->header.max_files, db_file->fpdb);
-    if(metadata_count != db_file->header.max_files) {
+    if(pread_full(fd, db_file->metadata, db_file->header.max_files * sizeof(struct pict_metadata), sizeof(struct pictdb_header)) != 0) {
         free(db_file->metadata);
+        fclose(db_file->fpdb);
         return ERR_IO;
     }
 
+    init_lock(db_file);
     return 0;
 }
 
@@ -122,16 +239,316 @@ int do_open(const char* filename, const char* mode, struct pictdb_file* db_file)
  *
  * @param db_file Pictbd_file to close
  */
-void do_close(const struct pictdb_file* db_file)
+void do_close(struct pictdb_file* db_file)
 {
     // Check if the pointer is defined
     if(db_file != NULL) {
-        free(db_file->metadata);
+        pthread_rwlock_destroy(&(db_file->lock));
+        index_free(db_file);
+        if(db_file->map != NULL) {
+            munmap(db_file->map, db_file->map_size);
+        } else {
+            free(db_file->metadata);
+        }
         fclose(db_file->fpdb);
     }
 
 }
 
+/**
+ * @brief Reload the metadata table of an opened pictdb_file after
+ *  header.max_files changed on the disk
+ *
+ * @param db_file Pictdb_file to reload, opened for writing
+ */
+int reload_metadata(struct pictdb_file* db_file)
+{
+    if(db_file == NULL || db_file->fpdb == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // the indexes are sized after max_files
+    index_free(db_file);
+    index_clear(db_file);
+
+    if(db_file->map != NULL) {
+        munmap(db_file->map, db_file->map_size);
+        db_file->map = NULL;
+        db_file->metadata = NULL;
+        return map_metadata(db_file, 1);
+    }
+
+    struct pict_metadata* metadata = realloc(db_file->metadata, db_file->header.max_files * sizeof(struct pict_metadata));
+    if(metadata == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    db_file->metadata = metadata;
+
+    return pread_full(fileno(db_file->fpdb), db_file->metadata,
+                      db_file->header.max_files * sizeof(struct pict_metadata), sizeof(struct pictdb_header));
+}
+
+/**
+ * @brief Make every write done so far to a pictdb_file durable
+ *
+ * @param db_file Pictdb_file to synchronize
+ */
+int sync_file(struct pictdb_file* db_file)
+{
+    if(db_file == NULL || db_file->fpdb == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if(fflush(db_file->fpdb) != 0) {
+        return ERR_IO;
+    }
+    if(db_file->map != NULL && msync(db_file->map, db_file->map_size, MS_SYNC) != 0) {
+        return ERR_IO;
+    }
+    if(fsync(fileno(db_file->fpdb)) != 0) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Make the image bytes written so far to a pictdb_file durable,
+ *        without the metadata of the mapping
+ *
+ * @param db_file Pictdb_file to synchronize
+ */
+int sync_data(struct pictdb_file* db_file)
+{
+    if(db_file == NULL || db_file->fpdb == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if(fdatasync(fileno(db_file->fpdb)) != 0) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Make a run of consecutive metadata entries durable, only the
+ *        pages of the mapping holding them are written
+ *
+ * @param db_file Pictdb_file to synchronize
+ * @param first Index of the first metadata to synchronize
+ * @param count Number of metadata to synchronize
+ */
+int sync_metadata_run(struct pictdb_file* db_file, size_t first, size_t count)
+{
+    if(db_file == NULL || db_file->fpdb == NULL || count == 0
+       || first >= db_file->header.max_files || count > db_file->header.max_files - first) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // the entries went through pwrite
+    if(db_file->map == NULL) {
+        return sync_data(db_file);
+    }
+
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t start = sizeof(struct pictdb_header) + (uint64_t) first * sizeof(struct pict_metadata);
+    uint64_t end = start + (uint64_t) count * sizeof(struct pict_metadata);
+    start -= start % page;
+    if(msync((char*) db_file->map + start, end - start, MS_SYNC) != 0) {
+        return ERR_IO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write the in-memory header to the database file
+ *
+ * @param db_file Pictdb_file whose header must be saved
+ */
+int write_header(struct pictdb_file* db_file)
+{
+    if(db_file == NULL || db_file->fpdb == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    if(db_file->map != NULL) {
+        memcpy(db_file->map, &(db_file->header), sizeof(struct pictdb_header));
+        return 0;
+    }
+
+    return pwrite_full(fileno(db_file->fpdb), &(db_file->header), sizeof(struct pictdb_header), 0);
+}
+
+/**
+ * @brief Write one metadata entry to the database file
+ *
+ * @param db_file Pictdb_file whose metadata must be saved
+ * @param index Index of the metadata to save
+ */
+int write_metadata(struct pictdb_file* db_file, size_t index)
+{
+    return write_metadata_run(db_file, index, 1);
+}
+
+/**
+ * @brief Write a run of consecutive metadata entries to the database file
+ *
+ * @param db_file Pictdb_file whose metadata must be saved
+ * @param first Index of the first metadata to save
+ * @param count Number of metadata to save
+ */
+int write_metadata_run(struct pictdb_file* db_file, size_t first, size_t count)
+{
+    if(db_file == NULL || db_file->fpdb == NULL || count == 0
+       || first >= db_file->header.max_files || count > db_file->header.max_files - first) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // the mapping already holds the modified entries
+    if(db_file->map != NULL) {
+        return 0;
+    }
+
+    return pwrite_full(fileno(db_file->fpdb), &(db_file->metadata[first]), count * sizeof(struct pict_metadata),
+                       sizeof(struct pictdb_header) + (uint64_t) first * sizeof(struct pict_metadata));
+}
+
+/**
+ * @brief Get the offset of the end of the database file
+ *
+ * @param db_file Pictdb_file to inspect
+ * @param end Return argument, size of the file
+ */
+int get_file_end(struct pictdb_file* db_file, uint64_t* end)
+{
+    if(db_file == NULL || db_file->fpdb == NULL || end == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // nothing goes through the stream buffer, the descriptor knows the size
+    struct stat st;
+    if(fstat(fileno(db_file->fpdb), &st) != 0) {
+        return ERR_IO;
+    }
+    *end = st.st_size;
+    return 0;
+}
+
+/**
+ * @brief Read image bytes at a 64 bits offset of the database file
+ *
+ * @param db_file Pictdb_file to read from
+ * @param buffer Buffer receiving the bytes
+ * @param size Number of bytes to read
+ * @param offset Offset of the bytes in the file
+ */
+int read_data(struct pictdb_file* db_file, void* buffer, size_t size, uint64_t offset)
+{
+    if(db_file == NULL || db_file->fpdb == NULL || buffer == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    return pread_full(fileno(db_file->fpdb), buffer, size, offset);
+}
+
+/**
+ * @brief Append image bytes at the end of the database file
+ *
+ * @param db_file Pictdb_file to append to
+ * @param buffer Bytes to write
+ * @param size Number of bytes to write
+ * @param offset Return argument, offset of the appended bytes
+ */
+int append_data(struct pictdb_file* db_file, const void* buffer, size_t size, uint64_t* offset)
+{
+    if(db_file == NULL || db_file->fpdb == NULL || buffer == NULL || offset == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    uint64_t end = 0;
+    int res = get_file_end(db_file, &end);
+    if(res != 0) {
+        return res;
+    }
+
+    res = pwrite_full(fileno(db_file->fpdb), buffer, size, end);
+    if(res != 0) {
+        return res;
+    }
+    *offset = end;
+    return 0;
+}
+
+/**
+ * @brief Take the lock of a database file for reading, once its indexes
+ *        are built
+ *
+ * The indexes are built lazily: the first reader builds them under the
+ * write lock, then waits for the read lock like the others.
+ *
+ * @param db_file Pictdb_file to lock
+ */
+int db_lock_read(struct pictdb_file* db_file)
+{
+    if(db_file == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    pthread_rwlock_rdlock(&(db_file->lock));
+    while(db_file->id_index.buckets == NULL) {
+        pthread_rwlock_unlock(&(db_file->lock));
+        pthread_rwlock_wrlock(&(db_file->lock));
+        int res = index_ensure(db_file);
+        pthread_rwlock_unlock(&(db_file->lock));
+        if(res != 0) {
+            return res;
+        }
+        pthread_rwlock_rdlock(&(db_file->lock));
+    }
+    return 0;
+}
+
+/**
+ * @brief Take the lock of a database file for reading without building
+ *        its indexes
+ *
+ * A one-shot read or list then costs a scan up to the image it looks
+ * for instead of a walk of the whole metadata table.
+ *
+ * @param db_file Pictdb_file to lock
+ */
+void db_lock_scan(struct pictdb_file* db_file)
+{
+    pthread_rwlock_rdlock(&(db_file->lock));
+}
+
+/**
+ * @brief Take the lock of a database file for writing
+ *
+ * @param db_file Pictdb_file to lock
+ */
+void db_lock_write(struct pictdb_file* db_file)
+{
+    pthread_rwlock_wrlock(&(db_file->lock));
+}
+
+/**
+ * @brief Take the lock of a database file for writing if no one holds it
+ *
+ * @param db_file Pictdb_file to lock
+ */
+int db_trylock_write(struct pictdb_file* db_file)
+{
+    return pthread_rwlock_trywrlock(&(db_file->lock));
+}
+
+/**
+ * @brief Release the lock of a database file
+ *
+ * @param db_file Pictdb_file to unlock
+ */
+void db_unlock(struct pictdb_file* db_file)
+{
+    pthread_rwlock_unlock(&(db_file->lock));
+}
+
 /**
  * @brief convert a string resolution to a code
  *
@@ -0,0 +1,63 @@
+/**
+ * @file db_warm.c
+ * @brief pictDB library: generation of the missing resized images
+ *
+ * Databases filled before the resized images were generated eagerly leave
+ * them all to their first read. Warming scans the metadata once, queues
+ * every image missing a resolution on a pool of resize workers under the
+ * read lock, then commits their results from the calling thread under the
+ * write lock, a batch at a time so that readers get through in between.
+ *
+ * @author Basile Thullen, Jeremy Hottinger
+ * @date 13 Jun 2016
+ */
+
+#include "pictDB.h"
+#include "db_index.h"
+#include "resize_pool.h"
+
+/**
+ * @brief generate the resized images missing in a database
+ *
+ * @param db_file opened database to warm
+ * @param res_code RES_THUMB or RES_SMALL, -1 for both
+ * @param nb_threads number of threads resizing the images
+ */
+int do_warm(struct pictdb_file* db_file, int res_code, unsigned int nb_threads)
+{
+    if(db_file == NULL || (res_code != -1 && res_code != RES_THUMB && res_code != RES_SMALL)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    int wanted[NB_RES] = { 0, 0, 0 };
+    if(res_code == -1) {
+        wanted[RES_THUMB] = 1;
+        wanted[RES_SMALL] = 1;
+    } else {
+        wanted[res_code] = 1;
+    }
+
+    struct resize_pool pool;
+    int res = resize_pool_start(&pool, db_file, nb_threads);
+    if(res != 0) {
+        return res;
+    }
+
+    // the new extents must be counted: the read lock builds the indexes
+    res = db_lock_read(db_file);
+    if(res != 0) {
+        resize_pool_stop(&pool);
+        return res;
+    }
+    uint32_t i = 0;
+    for(i = 0; res == 0 && i < db_file->header.max_files; i++) {
+        if(db_file->metadata[i].is_valid == NON_EMPTY) {
+            res = resize_pool_submit(&pool, i, wanted);
+        }
+    }
+    db_unlock(db_file);
+
+    int drained = resize_pool_drain(&pool, 1);
+    resize_pool_stop(&pool);
+    return res != 0 ? res : drained;
+}
@@ -7,158 +7,319 @@
  */
 
 #include "image_content.h"
+#include "db_index.h"
 
 VipsImage* resize(VipsImage* original, int new_w, int new_h);
 double resize_ratio(VipsImage* image, int resized_width, int resized_height);
 void free_ressources(void* res_buff_orig, VipsImage* global, VipsObject* process, void* res_buff);
+static int jpeg_dimensions(const unsigned char* buffer, size_t size, uint32_t* height, uint32_t* width);
+static int resize_image(void* orig, size_t orig_size, const uint32_t res_orig[2], int width, int height, VipsObject* process, VipsImage** resized);
+static int derive_image(VipsImage** source, int width, int height, VipsObject* process, VipsImage** derived);
 
 /**
- * @brief resize the image with the given id to the given resolution in a pictdb file.
+ * @brief decode and resize an image to fit in the given box, the decoder
+ *        shrinks the image while loading it so that the full resolution
+ *        original is never materialized
  *
- * @param res_code resolution code that indicates which resolution we want: RES_THUMB or RES_SMALL
- *
- * @param file pointer to the pictdb file
- *
- * @param image_id index of the image we want to resize
- *
- * @return 0 if successful, error code if not
+ * @param orig original image in memory
+ * @param orig_size size of the original image
+ * @param res_orig width and height of the original image, 0 if unknown
+ * @param width maximal width of the resized image
+ * @param height maximal height of the resized image
+ * @param process object owning the intermediate images
+ * @param resized return argument, resized image owned by process
  */
-int lazily_resize(int res_code, struct pictdb_file* file, size_t image_id)
+static int resize_image(void* orig, size_t orig_size, const uint32_t res_orig[2], int width, int height, VipsObject* process, VipsImage** resized)
 {
-
-    // check for good arguments
-    if(res_code == RES_ORIG) {
-        return 0;
-    } else if(res_code != RES_THUMB && res_code != RES_SMALL) {
-        return ERR_INVALID_ARGUMENT;
+#if VIPS_MAJOR_VERSION > 8 || (VIPS_MAJOR_VERSION == 8 && VIPS_MINOR_VERSION >= 8)
+    (void) res_orig;
+    VipsImage** images = (VipsImage**) vips_object_local_array(process, 1);
+    if(images == NULL) {
+        return ERR_VIPS;
     }
-
-    if((file == NULL) || (image_id > file->header.max_files)) {
-        return ERR_INVALID_ARGUMENT;
+    // picks the libjpeg DCT scaling and streams the decode
+    if(vips_thumbnail_buffer(orig, orig_size, &images[0], width, "height", height, "no_rotate", 1, NULL) != 0) {
+        return ERR_VIPS;
+    }
+    *resized = images[0];
+    return 0;
+#elif VIPS_MAJOR_VERSION > 7 || (VIPS_MAJOR_VERSION == 7 && VIPS_MINOR_VERSION > 40)
+    VipsImage** images = (VipsImage**) vips_object_local_array(process, 2);
+    if(images == NULL) {
+        return ERR_VIPS;
     }
 
-    // if the file exists
-    if(file->metadata[image_id].is_valid == NON_EMPTY) {
+    // libjpeg can scale by 1/2, 1/4 or 1/8 while decoding: take the largest
+    // factor that keeps the decoded image above the final size
+    int shrink = 1;
+    if(res_orig[0] > 0 && res_orig[1] > 0) {
+        double ratio_w = (double) width / res_orig[0];
+        double ratio_h = (double) height / res_orig[1];
+        double ratio = ratio_w < ratio_h ? ratio_w : ratio_h;
+        shrink = 8;
+        while(shrink > 1 && shrink * ratio > 1.0) {
+            shrink /= 2;
+        }
+    }
 
-        // if the image at resolution doesnt exists
-        if(file->metadata[image_id].offset[res_code] == 0) {
-            // shortcut for often used variables
-            size_t img_size = file->metadata[image_id].size[RES_ORIG];
+    if(vips_jpegload_buffer(orig, orig_size, &images[0], "shrink", shrink, "access", VIPS_ACCESS_SEQUENTIAL, NULL) != 0) {
+        return ERR_VIPS;
+    }
+    if(vips_resize(images[0], &images[1], resize_ratio(images[0], width, height), NULL) != 0) {
+        return ERR_VIPS;
+    }
+    *resized = images[1];
+    return 0;
+#else
+    // vips_resize was only introduced in libvips 7.42
+    printf("Requires vips version >= 7.42\n");
+    return ERR_VIPS;
+#endif
+}
 
-            // allocate memory for original and resized
-            void* res_buff_orig = malloc(img_size);
-            if(res_buff_orig == NULL) {
-                free_ressources(res_buff_orig, NULL, NULL, NULL);
-                return ERR_OUT_OF_MEMORY;
-            }
+/**
+ * @brief render an image in memory and resize it to fit in the given box
+ *
+ * The source is read twice, once to be saved and once to be resized: it is
+ * rendered in memory rather than decoded again from the original.
+ *
+ * @param source image to resize, replaced by its copy in memory
+ * @param width maximal width of the derived image
+ * @param height maximal height of the derived image
+ * @param process object owning the intermediate images
+ * @param derived return argument, derived image owned by process
+ */
+static int derive_image(VipsImage** source, int width, int height, VipsObject* process, VipsImage** derived)
+{
+    VipsImage** images = (VipsImage**) vips_object_local_array(process, 2);
+    if(images == NULL) {
+        return ERR_VIPS;
+    }
 
-            // we want 1 image
-            VipsImage *global = vips_image_new();
-            if(global == NULL) {
-                free_ressources(res_buff_orig, global, NULL, NULL);
-                return ERR_VIPS;
-            }
+    images[0] = vips_image_copy_memory(*source);
+    if(images[0] == NULL) {
+        return ERR_VIPS;
+    }
+    *source = images[0];
 
-            // seek and read from memory
-            if(fseek(file->fpdb, file->metadata[image_id].offset[RES_ORIG], SEEK_SET) != 0) {
-                return ERR_IO;
-            }
+    if(vips_resize(images[0], &images[1], resize_ratio(images[0], width, height), NULL) != 0) {
+        return ERR_VIPS;
+    }
+    *derived = images[1];
+    return 0;
+}
 
-            if(fread(res_buff_orig, img_size, 1, file->fpdb) != 1) {
-                return ERR_IO;
-            }
+/**
+ * @brief snapshot an image and the resolutions to generate for it
+ *
+ * @param job job to initialize
+ * @param file database file, the image must be valid
+ * @param image_id index of the image
+ * @param wanted non zero for each resolution to generate
+ */
+int resize_job_init(struct resize_job* job, const struct pictdb_file* file, size_t image_id, const int wanted[NB_RES])
+{
+    if(job == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    // a job is always safe to free
+    memset(job, 0, sizeof(struct resize_job));
 
-            VipsImage **original = (VipsImage**)vips_object_local_array(VIPS_OBJECT(global), 1);
-            if(original == NULL) {
-                return ERR_VIPS;
-            }
+    if(file == NULL || wanted == NULL || image_id >= file->header.max_files) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if(file->metadata[image_id].is_valid != NON_EMPTY) {
+        return ERR_INVALID_PICID;
+    }
 
-            // create image with vips_jpegload_buffer
-            if(vips_jpegload_buffer(res_buff_orig, img_size, original, NULL) != 0) {
-                return ERR_VIPS;
-            }
+    job->image_id = image_id;
+    job->metadata = file->metadata[image_id];
+    memcpy(job->res_resized, file->header.res_resized, sizeof(job->res_resized));
 
-            // start resize process
-            // some place to do the job
-            VipsObject* process = VIPS_OBJECT( vips_image_new() );
+    int r = 0;
+    for(r = 0; r < RES_ORIG; r++) {
+        job->missing[r] = wanted[r] && (job->metadata.offset[r] == 0 || job->metadata.size[r] == 0);
+        job->nb_missing += job->missing[r];
+    }
+    return 0;
+}
 
-            // we want 1 new images
-            VipsImage** thumbs = (VipsImage**) vips_object_local_array( process, 1 );
+/**
+ * @brief read, decode and resize the original of a job, then encode the
+ *        missing resolutions
+ *
+ * The original is decoded once. The thumbnail is derived from the small
+ * image when both are missing.
+ *
+ * @param job job made by resize_job_init
+ * @param file database file, only its data is read
+ */
+int resize_job_run(struct resize_job* job, struct pictdb_file* file)
+{
+    if(job == NULL || file == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if(job->nb_missing == 0) {
+        return 0;
+    }
 
-            double ratio = resize_ratio(original[0], file->header.res_resized[2*res_code], file->header.res_resized[(2*res_code)+1]);
+    const struct pict_metadata* metadata = &(job->metadata);
+    const uint16_t* box = job->res_resized;
 
-#if VIPS_MAJOR_VERSION > 7 || (VIPS_MAJOR_VERSION == 7 && MINOR_VERSION > 40)
-            // was only introduced in libvips 7.42
-            if(vips_resize(original[0], &thumbs[0], ratio, NULL) != 0) {
-                free_ressources(res_buff_orig, global, process, NULL);
-                return ERR_VIPS;
-            }
-#else
-            printf("Requires vips version >= 7.42\n");
-            free_ressources(res_buff_orig, global, process, NULL);
-            return ERR_VIPS;
-#endif
+    // shortcut for often used variables
+    size_t img_size = metadata->size[RES_ORIG];
 
+    // read the original image from the file
+    void* res_buff_orig = malloc(img_size);
+    if(res_buff_orig == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    if(read_data(file, res_buff_orig, img_size, metadata->offset[RES_ORIG]) != 0) {
+        free_ressources(res_buff_orig, NULL, NULL, NULL);
+        return ERR_IO;
+    }
 
-            if(thumbs[0] == NULL) {
-                free_ressources(res_buff_orig, global, process, NULL);
-                return ERR_VIPS;
-            }
+    // some place to do the job
+    VipsObject* process = VIPS_OBJECT( vips_image_new() );
+    if(process == NULL) {
+        free_ressources(res_buff_orig, NULL, NULL, NULL);
+        return ERR_VIPS;
+    }
 
-            // save on disk
-            void* res_buff = NULL;
-            size_t res_length = 0;
+    VipsImage* images[RES_ORIG] = { NULL, NULL };
+    int res = 0;
+    if(job->missing[RES_SMALL]) {
+        res = resize_image(res_buff_orig, img_size, metadata->res_orig,
+                           box[2*RES_SMALL], box[(2*RES_SMALL)+1], process, &images[RES_SMALL]);
+        // a thumbnail that fits in the small image is derived from it
+        if(res == 0 && job->missing[RES_THUMB]
+           && box[2*RES_THUMB] <= box[2*RES_SMALL] && box[(2*RES_THUMB)+1] <= box[(2*RES_SMALL)+1]) {
+            res = derive_image(&images[RES_SMALL], box[2*RES_THUMB], box[(2*RES_THUMB)+1],
+                               process, &images[RES_THUMB]);
+        }
+    }
+    if(res == 0 && job->missing[RES_THUMB] && images[RES_THUMB] == NULL) {
+        res = resize_image(res_buff_orig, img_size, metadata->res_orig,
+                           box[2*RES_THUMB], box[(2*RES_THUMB)+1], process, &images[RES_THUMB]);
+    }
 
-            if(vips_jpegsave_buffer(thumbs[0], &res_buff, &res_length, NULL) != 0) {
-                free_ressources(res_buff_orig, global, process, res_buff);
-                return ERR_VIPS;
+    // encode the new images
+    int r = 0;
+    for(r = 0; res == 0 && r < RES_ORIG; r++) {
+        if(job->missing[r]) {
+            if(images[r] == NULL || vips_jpegsave_buffer(images[r], &(job->buffers[r]), &(job->lengths[r]), NULL) != 0) {
+                res = ERR_VIPS;
             }
+        }
+    }
 
-            // go to the end of the file
-            if(fseek(file->fpdb, 0, SEEK_END) != 0) {
-                free_ressources(res_buff_orig, global, process, res_buff);
-                return ERR_IO;
-            }
+    free_ressources(res_buff_orig, NULL, process, NULL);
+    return res;
+}
 
-            // save offset
-            int off = ftell(file->fpdb);
-            if(off < 0) {
-                free_ressources(res_buff_orig, global, process, res_buff);
-                return ERR_IO;
-            }
+/**
+ * @brief append the images encoded by a job and make the metadata point
+ *        to them, with a single write
+ *
+ * Nothing is written if the image was deleted, moved or replaced since the
+ * job was made, or if the resized resolutions changed. A resolution
+ * generated by someone else in the meantime is kept.
+ *
+ * @param job job run by resize_job_run
+ * @param file database file, opened for writing
+ */
+int resize_job_commit(struct resize_job* job, struct pictdb_file* file)
+{
+    if(job == NULL || file == NULL || job->image_id >= file->header.max_files) {
+        return ERR_INVALID_ARGUMENT;
+    }
 
-            // write
-            if(fwrite(res_buff, res_length, 1, file->fpdb) != 1) {
-                free_ressources(res_buff_orig, global, process, res_buff);
-                return ERR_IO;
-            }
+    struct pict_metadata* metadata = &(file->metadata[job->image_id]);
+    if(metadata->is_valid != NON_EMPTY
+       || metadata->offset[RES_ORIG] != job->metadata.offset[RES_ORIG]
+       || memcmp(metadata->SHA, job->metadata.SHA, SHA256_DIGEST_LENGTH) != 0
+       || memcmp(file->header.res_resized, job->res_resized, sizeof(job->res_resized)) != 0) {
+        return 0;
+    }
 
-            // update metadata
-            file->metadata[image_id].offset[res_code] = off;
-            file->metadata[image_id].size[res_code] = res_length;
+    int keep[RES_ORIG];
+    int nb_keep = 0;
+    size_t total = 0;
+    int r = 0;
+    for(r = 0; r < RES_ORIG; r++) {
+        keep[r] = job->buffers[r] != NULL && (metadata->offset[r] == 0 || metadata->size[r] == 0);
+        if(keep[r]) {
+            nb_keep++;
+            total += job->lengths[r];
+        }
+    }
+    if(nb_keep == 0) {
+        return 0;
+    }
 
-            if(fseek(file->fpdb, sizeof(struct pictdb_header)+image_id*sizeof(struct pict_metadata), SEEK_SET) != 0) {
-                free_ressources(res_buff_orig, global, process, res_buff);
-                return ERR_IO;
+    // write the images together at the end of the file
+    char* blob = NULL;
+    const void* data = NULL;
+    if(nb_keep > 1) {
+        blob = malloc(total);
+        if(blob == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+        size_t pos = 0;
+        for(r = 0; r < RES_ORIG; r++) {
+            if(keep[r]) {
+                memcpy(blob + pos, job->buffers[r], job->lengths[r]);
+                pos += job->lengths[r];
             }
-
-            // write metadata
-            if(fwrite(&(file->metadata[image_id]), sizeof(struct pict_metadata), 1, file->fpdb) != 1) {
-                free_ressources(res_buff_orig, global, process, res_buff);
-                return ERR_IO;
+        }
+        data = blob;
+    } else {
+        for(r = 0; r < RES_ORIG; r++) {
+            if(keep[r]) {
+                data = job->buffers[r];
             }
+        }
+    }
 
-            free_ressources(res_buff_orig, global, process, res_buff);
+    uint64_t off = 0;
+    int res = append_data(file, data, total, &off);
+    free(blob);
+    if(res != 0) {
+        return ERR_IO;
+    }
 
-        } else {
-            return 0;
+    // update metadata
+    for(r = 0; r < RES_ORIG; r++) {
+        if(keep[r]) {
+            metadata->offset[r] = off;
+            metadata->size[r] = job->lengths[r];
+            index_extent_ref(file, off);
+            off += job->lengths[r];
         }
-    } else {
-        return ERR_INVALID_PICID;
+    }
+    if(write_metadata(file, job->image_id) != 0) {
+        return ERR_IO;
     }
     return 0;
 }
 
+/**
+ * @brief free the images encoded by a job
+ *
+ * @param job job to free
+ */
+void resize_job_free(struct resize_job* job)
+{
+    if(job != NULL) {
+        int r = 0;
+        for(r = 0; r < RES_ORIG; r++) {
+            free_ressources(NULL, NULL, NULL, job->buffers[r]);
+            job->buffers[r] = NULL;
+            job->lengths[r] = 0;
+        }
+    }
+}
+
 /**
  * @brief free ressources passed in parameters if they are not null
  */
@@ -194,6 +355,69 @@ double resize_ratio(VipsImage* image, int resized_width, int resized_height)
     return h_shrink > v_shrink ? v_shrink : h_shrink ;
 }
 
+/**
+ * @brief read the dimensions of a JPEG image from its start of frame
+ *        marker, without decoding anything
+ *
+ * Markers are walked from the start of image until a SOFn segment: every
+ * segment but the standalone markers carries its own length. The scan
+ * gives up at the start of scan, which must come after the frame header.
+ *
+ * @return 0 if the dimensions were found, -1 otherwise
+ */
+static int jpeg_dimensions(const unsigned char* buffer, size_t size, uint32_t* height, uint32_t* width)
+{
+    if(size < 4 || buffer[0] != 0xFF || buffer[1] != 0xD8) {
+        return -1;
+    }
+
+    size_t pos = 2;
+    while(pos + 4 <= size) {
+        if(buffer[pos] != 0xFF) {
+            return -1;
+        }
+        // any number of fill bytes may precede a marker
+        while(pos < size && buffer[pos] == 0xFF) {
+            pos++;
+        }
+        if(pos >= size) {
+            return -1;
+        }
+        unsigned char marker = buffer[pos++];
+
+        // standalone markers have no length
+        if(marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) {
+            continue;
+        }
+        if(marker == 0xD9 || marker == 0xDA || pos + 2 > size) {
+            return -1;
+        }
+
+        size_t length = ((size_t) buffer[pos] << 8) | buffer[pos + 1];
+        if(length < 2 || pos + length > size) {
+            return -1;
+        }
+
+        // SOF0 to SOF15, except DHT (C4), JPG (C8) and DAC (CC)
+        if(marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            if(length < 7) {
+                return -1;
+            }
+            uint32_t h = ((uint32_t) buffer[pos + 3] << 8) | buffer[pos + 4];
+            uint32_t w = ((uint32_t) buffer[pos + 5] << 8) | buffer[pos + 6];
+            // a height of 0 is defined later by a DNL marker
+            if(h == 0 || w == 0) {
+                return -1;
+            }
+            *height = h;
+            *width = w;
+            return 0;
+        }
+        pos += length;
+    }
+    return -1;
+}
+
 /**
  * @brief get the resolution of an image
  *
@@ -204,6 +428,15 @@ double resize_ratio(VipsImage* image, int resized_width, int resized_height)
  */
 int get_resolution(uint32_t* height, uint32_t* width, const char* image_buffer, size_t image_size)
 {
+    if(height == NULL || width == NULL || image_buffer == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // the frame header is enough, vips is only needed for unusual files
+    if(jpeg_dimensions((const unsigned char*) image_buffer, image_size, height, width) == 0) {
+        return 0;
+    }
+
     VipsImage *global = vips_image_new();
     if(global == NULL) {
         return ERR_VIPS;
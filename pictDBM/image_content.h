@@ -11,14 +11,55 @@
 
 #include "pictDB.h"
 
+/* Missing resolutions of an image, generated away from the database */
+struct resize_job {
+    size_t image_id;
+    struct pict_metadata metadata; // image when the job was made
+    uint16_t res_resized[2 * (NB_RES - 1)];
+    int missing[RES_ORIG];         // resolutions to generate
+    int nb_missing;
+    void* buffers[RES_ORIG];       // encoded images, set by resize_job_run
+    size_t lengths[RES_ORIG];
+};
+
 /**
- * @brief resize an image given by its id to a specified resolution
+ * @brief snapshot an image and the resolutions to generate for it, the
+ *        caller holds the lock of the database
  *
- * @param res_code resolution code at which to resize the image
+ * @param job job to initialize
  * @param file database file in which we find the image
  * @param image_id image id to resize
+ * @param wanted non zero for each resolution to generate
+ */
+int resize_job_init(struct resize_job* job, const struct pictdb_file* file, size_t image_id, const int wanted[NB_RES]);
+
+/**
+ * @brief decode the original of a job once and encode its missing
+ *        resolutions, the database is only read and its lock needn't be
+ *        held: a job reading an original moved meanwhile is dropped by
+ *        resize_job_commit
+ *
+ * @param job job made by resize_job_init
+ * @param file database file in which we find the image
+ */
+int resize_job_run(struct resize_job* job, struct pictdb_file* file);
+
+/**
+ * @brief append the images of a job and update the metadata, unless the
+ *        image changed since the job was made, the caller holds the write
+ *        lock of the database
+ *
+ * @param job job run by resize_job_run
+ * @param file database file in which we find the image
+ */
+int resize_job_commit(struct resize_job* job, struct pictdb_file* file);
+
+/**
+ * @brief free the images encoded by a job
+ *
+ * @param job job to free
  */
-int lazily_resize(int res_code, struct pictdb_file* file, size_t image_id);
+void resize_job_free(struct resize_job* job);
 
 /**
  * @brief get the resolution of an image in memory
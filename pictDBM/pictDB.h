@@ -26,6 +26,7 @@
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
 #include <string.h> // for strcmp
 #include <stdlib.h> // for malloc
+#include <pthread.h> // for pthread_rwlock_t
 #include <vips/vips.h>
 #include "pictDBM_tools.h"
 
@@ -42,6 +43,8 @@
 #define DEFAULT_MAX_FILES 10
 #define DEFAULT_THUMB_RES 64
 #define DEFAULT_SMALL_RES 256
+#define DEFAULT_GC_THRESHOLD 50
+#define MAX_GC_THRESHOLD 100
 
 /* For is_valid in pictdb_metadata */
 #define EMPTY 0
@@ -53,8 +56,15 @@
 #define RES_ORIG  2
 #define NB_RES    3
 
+/* do_open mode flag to map the metadata instead of reading them */
+#define MAP_MODE 'm'
+#define MAX_MODE_LENGTH 4
+
+/* maximal number of threads of a parallel operation */
+#define MAX_THREADS 64
+
 //number of available commands
-#define NB_CMD 7
+#define NB_CMD 11
 
 #ifdef __cplusplus
 extern "C" {
@@ -67,8 +77,8 @@ struct pictdb_header {
     uint32_t num_files;
     uint32_t max_files;
     uint16_t res_resized[2 * (NB_RES - 1)];
-    uint32_t unused_32;
-    uint64_t unused_64;
+    uint32_t gc_threshold; // percentage of dead bytes triggering compaction, 0 to disable
+    uint64_t dead_bytes;   // bytes of the file no image uses anymore
 };
 
 /* Define the metadata of an image contained in the database file */
@@ -82,11 +92,49 @@ struct pict_metadata {
     uint16_t unused_16;
 };
 
-/* Represent a database file */
+/* In-memory hash index from a key of the metadata to its slot */
+struct slot_index {
+    uint32_t* buckets; // slot + 1, 0 for an empty bucket
+    size_t mask;       // number of buckets - 1, always a power of two
+};
+
+/* In-memory hash table counting the images using each extent */
+struct ref_index {
+    uint64_t* offsets; // offset of the extent, 0 for an empty bucket
+    uint32_t* counts;  // number of valid images using the extent
+    size_t mask;       // number of buckets - 1, always a power of two
+};
+
+/* An image given to do_insert_batch, and the result of its insertion */
+struct pict_insert {
+    const char* img_array;
+    size_t img_size;
+    const char* img_id;
+    unsigned char SHA[SHA256_DIGEST_LENGTH]; // set by prepare_insert
+    uint32_t res_orig[2];                    // set by prepare_insert
+    int prepared; // whether prepare_insert already ran on the image
+    int result;   // 0 if the image was inserted, error code if not
+};
+
+/* Represent a database file
+ *
+ * A handle can be shared by several threads: the do_* functions take its
+ * lock themselves, shared by the readers and held alone by the writer. The
+ * lower level functions expect their caller to hold it. The file is only
+ * accessed with pread and pwrite, never through the stream position.
+ */
 struct pictdb_file {
     FILE* fpdb;
     struct pictdb_header header;
     struct pict_metadata* metadata;
+    void* map;       // mapping of header and metadata, NULL if not mapped
+    size_t map_size;
+    struct slot_index id_index;  // pict_id -> slot, valid images only
+    struct slot_index sha_index; // SHA -> slots sharing this content
+    uint64_t* free_slots;        // one bit set for every empty slot
+    size_t free_hint;            // no word below this one has a free bit
+    struct ref_index extent_refs; // offset -> number of images using it
+    pthread_rwlock_t lock;        // readers share it, a writer holds it alone
 };
 
 /* Define modes for do list */
@@ -114,7 +162,7 @@ void print_metadata (const struct pict_metadata* metadata);
  * @param db_file In memory structure with header and metadata.
  */
 
-char* do_list(const struct pictdb_file* file, do_list_mode mode);
+char* do_list(struct pictdb_file* file, do_list_mode mode);
 
 /**
  * @brief Creates the database called db_filename. Writes the header and the
@@ -127,6 +175,8 @@ int do_create(const char* filename, struct pictdb_file* db_file);
 /**
  * @brief Delete an image from a database file
  *
+ * Builds the indexes of the database first if they are not yet.
+ *
  * @param name Name of the image to delete
  * @param file File from which the image must be deleted
  */
@@ -136,7 +186,8 @@ int do_delete(const char* name, struct pictdb_file* file);
  * @brief Open a database file from the disk
  *
  * @param filename Name of the database file on disk
- * @param mode mode in which the file will be open
+ * @param mode mode in which the file will be open, as for fopen, plus
+ *        MAP_MODE to map the metadata instead of reading them
  * @param file File to store the opened database
  */
 int do_open(const char* filename, const char* mode, struct pictdb_file* file);
@@ -146,7 +197,133 @@ int do_open(const char* filename, const char* mode, struct pictdb_file* file);
  *
  * @param file File to close
  */
-void do_close(const struct pictdb_file* file);
+void do_close(struct pictdb_file* file);
+
+/**
+ * @brief Reload the metadata table after header.max_files changed
+ *
+ * @param file File to reload, opened for writing
+ */
+int reload_metadata(struct pictdb_file* file);
+
+/**
+ * @brief Make every write done so far to a database file durable
+ *
+ * @param file File to synchronize
+ */
+int sync_file(struct pictdb_file* file);
+
+/**
+ * @brief Make the image bytes written so far to a database file durable,
+ *        with a single fdatasync
+ *
+ * @param file File to synchronize
+ */
+int sync_data(struct pictdb_file* file);
+
+/**
+ * @brief Make a run of consecutive metadata entries durable, a mapped
+ *        table only writes back the pages holding them
+ *
+ * @param file File to synchronize
+ * @param first Index of the first metadata to synchronize
+ * @param count Number of metadata to synchronize
+ */
+int sync_metadata_run(struct pictdb_file* file, size_t first, size_t count);
+
+/**
+ * @brief Write the in-memory header to the database file
+ *
+ * @param file File whose header must be saved
+ */
+int write_header(struct pictdb_file* file);
+
+/**
+ * @brief Write one metadata entry to the database file
+ *
+ * @param file File whose metadata must be saved
+ * @param index Index of the metadata to save
+ */
+int write_metadata(struct pictdb_file* file, size_t index);
+
+/**
+ * @brief Write a run of consecutive metadata entries to the database file
+ *        with a single write
+ *
+ * @param file File whose metadata must be saved
+ * @param first Index of the first metadata to save
+ * @param count Number of metadata to save
+ */
+int write_metadata_run(struct pictdb_file* file, size_t first, size_t count);
+
+/**
+ * @brief Get the offset of the end of the database file, where the next
+ *        image bytes will be appended
+ *
+ * @param file File to inspect
+ * @param end Return argument, size of the file
+ */
+int get_file_end(struct pictdb_file* file, uint64_t* end);
+
+/**
+ * @brief Read image bytes at a 64 bits offset of the database file,
+ *        without moving the file position
+ *
+ * @param file File to read from
+ * @param buffer Buffer receiving the bytes
+ * @param size Number of bytes to read
+ * @param offset Offset of the bytes in the file
+ */
+int read_data(struct pictdb_file* file, void* buffer, size_t size, uint64_t offset);
+
+/**
+ * @brief Append image bytes at the end of the database file
+ *
+ * @param file File to append to
+ * @param buffer Bytes to write
+ * @param size Number of bytes to write
+ * @param offset Return argument, 64 bits offset of the appended bytes
+ */
+int append_data(struct pictdb_file* file, const void* buffer, size_t size, uint64_t* offset);
+
+/**
+ * @brief Take the lock of a database file for reading, once its indexes
+ *        are built so that readers never modify them
+ *
+ * @param file File to lock
+ */
+int db_lock_read(struct pictdb_file* file);
+
+/**
+ * @brief Take the lock of a database file for reading without building
+ *        its indexes, for a reader that only walks the metadata
+ *
+ * @param file File to lock
+ */
+void db_lock_scan(struct pictdb_file* file);
+
+/**
+ * @brief Take the lock of a database file for writing
+ *
+ * @param file File to lock
+ */
+void db_lock_write(struct pictdb_file* file);
+
+/**
+ * @brief Take the lock of a database file for writing if no one holds it
+ *
+ * @param file File to lock
+ *
+ * @return 0 if the lock was taken, non zero otherwise
+ */
+int db_trylock_write(struct pictdb_file* file);
+
+/**
+ * @brief Release the lock of a database file
+ *
+ * @param file File to unlock
+ */
+void db_unlock(struct pictdb_file* file);
 
 /**
  * @brief convert a string into a resolution code
@@ -169,6 +346,8 @@ int do_read(const char* img_id, int res_code, char** img_array, uint32_t* size,
 /**
  * @brief insert an image in the database
  *
+ * Builds the indexes of the database first if they are not yet.
+ *
  * @param img_array the array containing the image to insert
  * @param img_size the size of the image
  * @param img_id new id for image
@@ -176,7 +355,105 @@ int do_read(const char* img_id, int res_code, char** img_array, uint32_t* size,
  */
 int do_insert(const char* img_array, size_t img_size, const char* img_id, struct pictdb_file* db_file);
 
-int do_gbcollect(struct pictdb_file* db_file, char* orig_filename, char* new_filename);
+/**
+ * @brief compute the SHA and the resolution of an image to insert, does
+ *        not access any database so it can run concurrently
+ *
+ * @param image image to prepare, its prepared field is set on success
+ *
+ * @return 0 if successful, error code if not
+ */
+int prepare_insert(struct pict_insert* image);
+
+/**
+ * @brief insert several images in the database at once
+ *
+ * The new contents are appended with a single vectored write, the header
+ * is written once and the metadata in runs of consecutive slots. Every
+ * image gets its own result: a duplicate id or an invalid image doesn't
+ * prevent the others from being inserted. The images not prepared yet are
+ * prepared by the function.
+ *
+ * @param images images to insert, their result field is set
+ * @param count number of images
+ * @param db_file file in which to insert the images
+ *
+ * @return 0 if the batch was written, error code if not (then no image
+ *         was inserted)
+ */
+int do_insert_batch(struct pict_insert* images, size_t count, struct pictdb_file* db_file);
+
+/**
+ * @brief insert every JPEG image of a directory, named after its file
+ *
+ * Worker threads read and prepare the images while the calling thread
+ * inserts them in batches. The images that can't be inserted are reported
+ * and skipped.
+ *
+ * @param db_file file in which to insert the images
+ * @param dirname directory containing the images
+ * @param nb_threads number of threads preparing the images
+ *
+ * @return 0 if successful, error code if the import had to stop
+ */
+int do_import(struct pictdb_file* db_file, const char* dirname, unsigned int nb_threads);
+
+/**
+ * @brief enlarge the metadata table of a database in place
+ *
+ * @param db_file opened database to grow
+ * @param new_max_files new maximum number of images
+ */
+int do_grow(struct pictdb_file* db_file, uint32_t new_max_files);
+
+/**
+ * @brief generate the resized images missing in a database
+ *
+ * Worker threads decode the originals and encode the missing resolutions
+ * while the calling thread appends them to the database. The images that
+ * can't be resized are reported and skipped.
+ *
+ * @param db_file opened database to warm
+ * @param res_code RES_THUMB or RES_SMALL, -1 for both
+ * @param nb_threads number of threads resizing the images
+ *
+ * @return 0 if successful, error code if the database couldn't be written
+ */
+int do_warm(struct pictdb_file* db_file, int res_code, unsigned int nb_threads);
+
+/**
+ * @brief change the resized resolutions of a database
+ *
+ * The resized images of the changed resolutions are dropped, then
+ * generated again at the new resolution by worker threads.
+ *
+ * @param db_file opened database to reconfigure
+ * @param res_resized new thumbnail and small resolutions, as in the header
+ * @param nb_threads number of threads resizing the images
+ *
+ * @return 0 if successful, error code if not
+ */
+int do_reconfigure(struct pictdb_file* db_file, const uint16_t res_resized[2 * (NB_RES - 1)], unsigned int nb_threads);
+
+/**
+ * @brief garbage collect a database by copying its live extents byte for
+ *        byte into a new file that then replaces the old one
+ *
+ * @param db_file opened database to collect
+ * @param orig_filename filename of the database
+ * @param new_filename temporary filename for the collected database
+ * @param nb_threads number of threads copying the extents
+ */
+int do_gbcollect(struct pictdb_file* db_file, char* orig_filename, char* new_filename, unsigned int nb_threads);
+
+/**
+ * @brief compact a database in place by sliding its live extents over the
+ *        dead space and truncating the tail, without a temporary file
+ *
+ * @param db_file opened database to compact
+ * @param nb_threads number of threads copying the extents
+ */
+int do_compact(struct pictdb_file* db_file, unsigned int nb_threads);
 
 #ifdef __cplusplus
 }
@@ -10,6 +10,7 @@
 
 #include "pictDB.h"
 #include "image_content.h"
+#include "db_compact.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -48,7 +49,7 @@ do_list_cmd(int args, char *argv[])
     struct pictdb_file file;
 
     // Check for opening problems
-    if(do_open(filename, "rb+", &file) != 0) {
+    if(do_open(filename, "rb+m", &file) != 0) {
         return ERR_IO;
     }
 
@@ -135,7 +136,7 @@ int do_insert_cmd(int args, char *argv[])
     struct pictdb_file file;
 
     // Check for opening problems
-    if(do_open(db_filename, "rb+", &file) != 0) {
+    if(do_open(db_filename, "rb+m", &file) != 0) {
         return ERR_IO;
     }
 
@@ -240,7 +241,7 @@ int do_read_cmd(int args, char *argv[])
     struct pictdb_file file;
 
     // Check for opening problems
-    if(do_open(db_filename, "rb+", &file) != 0) {
+    if(do_open(db_filename, "rb+m", &file) != 0) {
         return ERR_IO;
     }
 
@@ -294,6 +295,7 @@ do_create_cmd (int args, char *argv[])
     uint16_t thumb_res_y =  DEFAULT_THUMB_RES;
     uint16_t small_res_x = DEFAULT_SMALL_RES;
     uint16_t small_res_y = DEFAULT_SMALL_RES;
+    uint32_t gc_threshold = DEFAULT_GC_THRESHOLD;
 
     if(args > 2) {
         int i = 2;
@@ -332,6 +334,16 @@ do_create_cmd (int args, char *argv[])
                 small_res_x = resx;
                 small_res_y = resy;
                 i += 3;
+            } else if(!strcmp(argv[i], "-gc_threshold")) {
+                if(args - 1 - i < 1) {
+                    return ERR_NOT_ENOUGH_ARGUMENTS;
+                }
+                uint32_t res = atouint32(argv[i+1]);
+                if(res > MAX_GC_THRESHOLD) {
+                    return ERR_INVALID_ARGUMENT;
+                }
+                gc_threshold = res;
+                i += 2;
             } else {
                 return ERR_INVALID_ARGUMENT;
             }
@@ -346,6 +358,7 @@ do_create_cmd (int args, char *argv[])
     db_file.header.res_resized[1] = thumb_res_y;
     db_file.header.res_resized[2] = small_res_x;
     db_file.header.res_resized[3] = small_res_y;
+    db_file.header.gc_threshold = gc_threshold;
 
     // create the file
     int res = do_create(filename, &db_file);
@@ -358,29 +371,249 @@ do_create_cmd (int args, char *argv[])
     return res;
 }
 
+/**
+ * @brief garbage collects a database, in place if no temporary file is given
+ */
 int do_gc_cmd(int args, char* argv[])
 {
 
-    if(argv[1] == NULL || argv[2] == NULL) {
+    if(args < 2 || argv[1] == NULL) {
         return ERR_NOT_ENOUGH_ARGUMENTS;
     }
-    if(strlen(argv[1]) > MAX_DB_NAME || strlen(argv[2]) > MAX_DB_NAME) {
-        return ERR_INVALID_ARGUMENT;
+    char* old_db_file_name = argv[1];
+    char* tmp_file_name = NULL;
+    unsigned int nb_threads = 1;
+
+    int i = 2;
+    while(i < args) {
+        if(!strcmp(argv[i], "-j")) {
+            if(args - 1 - i < 1) {
+                return ERR_NOT_ENOUGH_ARGUMENTS;
+            }
+            nb_threads = atouint32(argv[i+1]);
+            if(nb_threads == 0 || nb_threads > MAX_THREADS) {
+                return ERR_INVALID_ARGUMENT;
+            }
+            i += 2;
+        } else if(tmp_file_name == NULL) {
+            tmp_file_name = argv[i];
+            i++;
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
     }
 
-    char* old_db_file_name = argv[1];
-    char* tmp_file_name = argv[2];
+    if(strlen(old_db_file_name) > MAX_DB_NAME || (tmp_file_name != NULL && strlen(tmp_file_name) > MAX_DB_NAME)) {
+        return ERR_INVALID_ARGUMENT;
+    }
 
     struct pictdb_file old_db_file;
     int res = 0;
-    if((res = do_open(old_db_file_name, "rb+", &old_db_file)) != 0) {
+    if((res = do_open(old_db_file_name, "rb+m", &old_db_file)) != 0) {
         return res;
     }
-    if((res = do_gbcollect(&old_db_file, old_db_file_name, tmp_file_name)) != 0) {
-        return res;
+    if(tmp_file_name == NULL) {
+        res = do_compact(&old_db_file, nb_threads);
+    } else {
+        res = do_gbcollect(&old_db_file, old_db_file_name, tmp_file_name, nb_threads);
     }
+    do_close(&old_db_file);
 
-    return 0;
+    return res;
+}
+
+/**
+ * @brief enlarges the metadata table of a database
+ */
+int do_grow_cmd(int args, char* argv[])
+{
+    if(args < 3) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    char* db_filename = argv[1];
+    if(db_filename == NULL || db_filename[0] == '\0' || strlen(db_filename) > MAX_DB_NAME) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    uint32_t max_files = atouint32(argv[2]);
+    if(max_files == 0 || max_files > MAX_MAX_FILES) {
+        return ERR_MAX_FILES;
+    }
+
+    struct pictdb_file file;
+    if(do_open(db_filename, "rb+m", &file) != 0) {
+        return ERR_IO;
+    }
+
+    int res = do_grow(&file, max_files);
+    if(res == 0) {
+        print_header(&(file.header));
+    }
+
+    do_close(&file);
+    return res;
+}
+
+/**
+ * @brief inserts every JPEG image of a directory
+ */
+int do_import_cmd(int args, char* argv[])
+{
+    if(args < 3) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    char* db_filename = argv[1];
+    char* dirname = argv[2];
+    if(db_filename == NULL || db_filename[0] == '\0' || strlen(db_filename) > MAX_DB_NAME) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if(dirname == NULL || dirname[0] == '\0') {
+        return ERR_INVALID_FILENAME;
+    }
+
+    unsigned int nb_threads = 1;
+    int i = 3;
+    while(i < args) {
+        if(!strcmp(argv[i], "-j")) {
+            if(args - 1 - i < 1) {
+                return ERR_NOT_ENOUGH_ARGUMENTS;
+            }
+            nb_threads = atouint32(argv[i+1]);
+            if(nb_threads == 0 || nb_threads > MAX_THREADS) {
+                return ERR_INVALID_ARGUMENT;
+            }
+            i += 2;
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    struct pictdb_file file;
+    if(do_open(db_filename, "rb+m", &file) != 0) {
+        return ERR_IO;
+    }
+
+    int res = do_import(&file, dirname, nb_threads);
+    do_close(&file);
+    return res;
+}
+
+/**
+ * @brief generates the missing resized images of a database
+ */
+int do_warm_cmd(int args, char* argv[])
+{
+    if(args < 2) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    char* db_filename = argv[1];
+    if(db_filename == NULL || db_filename[0] == '\0' || strlen(db_filename) > MAX_DB_NAME) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    int res_code = -1;
+    unsigned int nb_threads = 1;
+    int i = 2;
+    while(i < args) {
+        if(args - 1 - i < 1) {
+            return ERR_NOT_ENOUGH_ARGUMENTS;
+        }
+        if(!strcmp(argv[i], "-res")) {
+            res_code = resolution_atoi(argv[i+1]);
+            if(res_code != RES_THUMB && res_code != RES_SMALL) {
+                return ERR_RESOLUTIONS;
+            }
+        } else if(!strcmp(argv[i], "-j")) {
+            nb_threads = atouint32(argv[i+1]);
+            if(nb_threads == 0 || nb_threads > MAX_THREADS) {
+                return ERR_INVALID_ARGUMENT;
+            }
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+        i += 2;
+    }
+
+    struct pictdb_file file;
+    if(do_open(db_filename, "rb+m", &file) != 0) {
+        return ERR_IO;
+    }
+
+    int res = do_warm(&file, res_code, nb_threads);
+    do_close(&file);
+    return res;
+}
+
+/**
+ * @brief changes the resized resolutions of a database
+ */
+int do_reconfigure_cmd(int args, char* argv[])
+{
+    if(args < 2) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    char* db_filename = argv[1];
+    if(db_filename == NULL || db_filename[0] == '\0' || strlen(db_filename) > MAX_DB_NAME) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // 0 keeps the resolution of the database
+    uint16_t res_resized[2 * (NB_RES - 1)] = { 0, 0, 0, 0 };
+    unsigned int nb_threads = 1;
+    int i = 2;
+    while(i < args) {
+        if(!strcmp(argv[i], "-thumb_res") || !strcmp(argv[i], "-small_res")) {
+            if(args - 1 - i < 2) {
+                return ERR_NOT_ENOUGH_ARGUMENTS;
+            }
+            int res_code = !strcmp(argv[i], "-thumb_res") ? RES_THUMB : RES_SMALL;
+            uint16_t max_res = res_code == RES_THUMB ? MAX_THUMB_RES : MAX_SMALL_RES;
+            uint16_t resx = atouint16(argv[i+1]);
+            uint16_t resy = atouint16(argv[i+2]);
+            if(resx == 0 || resy == 0 || resx > max_res || resy > max_res) {
+                return ERR_RESOLUTIONS;
+            }
+            res_resized[2*res_code] = resx;
+            res_resized[(2*res_code)+1] = resy;
+            i += 3;
+        } else if(!strcmp(argv[i], "-j")) {
+            if(args - 1 - i < 1) {
+                return ERR_NOT_ENOUGH_ARGUMENTS;
+            }
+            nb_threads = atouint32(argv[i+1]);
+            if(nb_threads == 0 || nb_threads > MAX_THREADS) {
+                return ERR_INVALID_ARGUMENT;
+            }
+            i += 2;
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    struct pictdb_file file;
+    if(do_open(db_filename, "rb+m", &file) != 0) {
+        return ERR_IO;
+    }
+
+    size_t k = 0;
+    for(k = 0; k < 2 * (NB_RES - 1); k++) {
+        if(res_resized[k] == 0) {
+            res_resized[k] = file.header.res_resized[k];
+        }
+    }
+
+    int res = do_reconfigure(&file, res_resized, nb_threads);
+
+    // the old resized images are dead bytes now
+    if(res == 0 && compact_needed(&file)) {
+        res = do_compact(&file, nb_threads);
+    }
+    do_close(&file);
+    return res;
 }
 
 /**
@@ -403,12 +636,32 @@ help (int args, char *argv[])
     printf("          -small_res <X_RES> <Y_RES>: resolution for small images.\n");
     printf("                                  default value is 256x256\n");
     printf("                                  maximum value is 512x512\n");
+    printf("          -gc_threshold <PERCENT>: percentage of dead bytes triggering compaction.\n");
+    printf("                                  default value is %d, 0 disables it\n", DEFAULT_GC_THRESHOLD);
+    printf("                                  maximum value is %d\n", MAX_GC_THRESHOLD);
     printf("  read   <dbfilename> <pictID> [original|orig|thumbnail|thumb|small]:\n");
     printf("      read an image from the pictDB and save it to a file.\n");
     printf("      default resolution is \"original\".\n");
     printf("  insert <dbfilename> <pictID> <filename>: insert a new image in the pictDB.\n");
     printf("  delete <dbfilename> <pictID>: delete picture pictID from pictDB.\n");
-    printf("  gc <dbfilename> <tmp dbfilename>: performs garbage collecting on pictDB. Requires a temporary filename for copying the pictDB.\n");
+    printf("  gc <dbfilename> [tmp dbfilename] [-j <N>]: performs garbage collecting on pictDB.\n");
+    printf("      with a temporary filename, the pictDB is copied into it.\n");
+    printf("      without, the pictDB is compacted in place.\n");
+    printf("      -j <N>: number of threads copying the images, default value is 1\n");
+    printf("      images are copied in the kernel when possible; blocks are only shared\n");
+    printf("      (reflink) for the images whose offset and size are block aligned.\n");
+    printf("  grow <dbfilename> <MAX_FILES>: enlarges pictDB to hold up to MAX_FILES images.\n");
+    printf("      the images moved to make room are copied like with gc.\n");
+    printf("  import <dbfilename> <directory> [-j <N>]: insert every JPEG image of a directory.\n");
+    printf("      the pictID of an image is its filename.\n");
+    printf("      -j <N>: number of threads reading the images, default value is 1\n");
+    printf("  warm <dbfilename> [-res <thumb|small>] [-j <N>]: generates the missing resized images.\n");
+    printf("      -res <RES>: only this resolution, default is both\n");
+    printf("      -j <N>: number of threads resizing the images, default value is 1\n");
+    printf("  reconfigure <dbfilename> [-thumb_res <X_RES> <Y_RES>] [-small_res <X_RES> <Y_RES>] [-j <N>]:\n");
+    printf("      changes the resolutions of the resized images and generates them again.\n");
+    printf("      maximum values are the ones of create\n");
+    printf("      -j <N>: number of threads resizing the images, default value is 1\n");
     return 0;
 }
 
@@ -436,7 +689,7 @@ do_delete_cmd(int args, char *argv[])
     struct pictdb_file file;
 
     // Open the file
-    if(do_open(filename, "rb+", &file) != 0) {
+    if(do_open(filename, "rb+m", &file) != 0) {
         return ERR_IO;
     }
 
@@ -447,6 +700,15 @@ do_delete_cmd(int args, char *argv[])
         return res;
     }
 
+    // reclaim the dead bytes once they exceed the threshold of the database
+    if(compact_needed(&file)) {
+        res = do_compact(&file, 1);
+        if(res != 0) {
+            do_close(&file);
+            return res;
+        }
+    }
+
     // close the file
     do_close(&file);
 
@@ -474,7 +736,11 @@ int main (int argc, char* argv[])
             {"help", help},
             {"insert", do_insert_cmd},
             {"read", do_read_cmd},
-            {"gc", do_gc_cmd}
+            {"gc", do_gc_cmd},
+            {"grow", do_grow_cmd},
+            {"import", do_import_cmd},
+            {"warm", do_warm_cmd},
+            {"reconfigure", do_reconfigure_cmd}
         };
 
         argc--;
@@ -2,6 +2,18 @@
  * @file pictDB_server.c
  * @brief HTTP server to use the Picture Database Management Tool
  *
+ * The mongoose loop only parses the requests and sends the responses. The
+ * database work of a request runs on a pool of worker threads: reads share
+ * the database, writes hold it alone. A worker hands the finished request
+ * back to the loop with mg_broadcast, and the loop writes the response on
+ * the connection.
+ *
+ * A read missing its resized image doesn't keep a worker waiting for vips:
+ * the image is resized by the resize pool, and once the loop has written
+ * it the request is queued again for a worker to read it.
+ *
+ * The dead space left by the deletes is compacted by a thread of its own,
+ * which holds the write lock only to repoint the moved images.
  *
  * @author Basile Thullen - Jeremy Hottinger
  * @date 17 May 2016
@@ -9,9 +21,26 @@
 
 #include "libmongoose/mongoose.h"
 #include "pictDB.h"
+#include "db_compact.h"
+#include "db_index.h"
+#include "resize_pool.h"
+
+#include <pthread.h>
+#include <unistd.h>     // for sysconf
 
 // maximum number of parameters in the query string
 #define MAX_QUERY_PARAM 5
+// number of extents repointed at once by the online compaction
+#define COMPACT_SLICE_EXTENTS 64
+// wait between two polls while resized images are being generated
+#define RESIZE_POLL_MS 10
+// wait between two polls while the workers finish, on exit
+#define EXIT_POLL_MS 10
+
+// connection flags: a worker handles its request, and it must be closed
+// after the response because it sent another request meanwhile
+#define MG_F_IN_FLIGHT MG_F_USER_1
+#define MG_F_CLOSE_AFTER MG_F_USER_2
 
 // boolean to signal if the program is terminated
 static int s_sig_received = 0;
@@ -19,6 +48,49 @@ static int s_sig_received = 0;
 static struct mg_serve_http_opts s_http_server_opts;
 // port on which the server will be binded
 static const char *s_http_port = "8000";
+// thread compacting the database, and whether a compaction is needed
+static pthread_t s_compactor;
+static pthread_mutex_t s_compact_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_compact_cond = PTHREAD_COND_INITIALIZER;
+static int s_compact_wanted = 0;
+static int s_compact_stopping = 0;
+// workers generating the missing resized images, and whether they do it
+// for the new images too, with -eager
+static struct resize_pool s_resize_pool;
+static int s_eager = 0;
+
+/* Actions handled by the request workers */
+enum action {
+    ACTION_LIST, ACTION_READ, ACTION_INSERT, ACTION_DELETE
+};
+
+/* A request handled by a worker, then answered by the loop */
+struct request {
+    struct mg_connection* nc;
+    struct pictdb_file* db_file;
+    enum action action;
+    char pict_id[MAX_PIC_ID + 1];
+    int res_code;
+    char* image;        // image inserted or read
+    size_t image_size;
+    char* list;         // json list of the pictures
+    int result;         // 0 or error code of the action
+    int resized;        // the resize pool already ran for the read
+    struct request* next;
+};
+
+// workers and their queue of requests
+static pthread_t s_workers[MAX_THREADS];
+static unsigned int s_nb_workers = 0;
+static unsigned int s_running_workers = 0;
+static pthread_mutex_t s_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_queue_cond = PTHREAD_COND_INITIALIZER;
+static struct request* s_queue = NULL;
+static struct request* s_queue_tail = NULL;
+static int s_stopping = 0;
+// loop the responses are sent back to, and its listening connection
+static struct mg_mgr* s_mgr = NULL;
+static struct mg_connection* s_listener = NULL;
 
 /* handler for actions */
 static void handle_list_call(struct mg_connection* nc, struct http_message* hm);
@@ -26,6 +98,28 @@ static void handle_read_call(struct mg_connection* nc, struct http_message* hm);
 static void handle_insert_call(struct mg_connection* nc, struct http_message* hm);
 static void handle_delete_call(struct mg_connection* nc, struct http_message* hm);
 
+/* request workers */
+static struct request* new_request(struct mg_connection* nc, enum action action);
+static void free_request(struct request* req);
+static void enqueue(struct request* req);
+static void dispatch(struct request* req);
+static int read_request(struct request* req);
+static int run_request(struct request* req);
+static void* request_worker(void* arg);
+static void resize_finished(void* waiter, int result);
+static struct mg_connection* find_connection(struct mg_mgr* mgr, struct request* req);
+static void answer(struct mg_connection* nc, struct request* req);
+static void deliver_response(struct mg_connection* nc, int ev, void* p);
+static void send_response(struct mg_connection* nc, struct request* req);
+static int start_workers(unsigned int nb_workers);
+static void stop_workers(struct mg_mgr* mgr);
+
+/* online compaction */
+static void want_compaction(void);
+static int compaction_stopping(void);
+static void compact_online(struct pictdb_file* db_file);
+static void* compactor(void* arg);
+
 /* request and signals handler */
 static void ev_handler(struct mg_connection *nc, int ev, void *p);
 static void signal_handler(int sig_num);
@@ -73,22 +167,88 @@ static void send_header(struct mg_connection* nc, const char* code, const char*
 }
 
 /**
- * @brief send a json formatted version of the list command
+ * @brief create a request for a connection
+ *
+ * @param nc connection which sent the request
+ * @param action action requested
+ *
+ * @return the request, NULL if out of memory
+ */
+static struct request* new_request(struct mg_connection* nc, enum action action)
+{
+    struct request* req = calloc(1, sizeof(struct request));
+    if(req != NULL) {
+        req->nc = nc;
+        req->db_file = (struct pictdb_file*)nc->user_data;
+        req->action = action;
+    }
+    return req;
+}
+
+/**
+ * @brief free a request and what its action produced
+ *
+ * @param req request to free
+ */
+static void free_request(struct request* req)
+{
+    if(req != NULL) {
+        free(req->image);
+        free(req->list);
+        free(req);
+    }
+}
+
+/**
+ * @brief queue a request for the workers
+ *
+ * @param req request to queue
+ */
+static void enqueue(struct request* req)
+{
+    req->next = NULL;
+    pthread_mutex_lock(&s_queue_lock);
+    if(s_queue_tail != NULL) {
+        s_queue_tail->next = req;
+    } else {
+        s_queue = req;
+    }
+    s_queue_tail = req;
+    pthread_cond_signal(&s_queue_cond);
+    pthread_mutex_unlock(&s_queue_lock);
+}
+
+/**
+ * @brief queue a request for the workers, the connection keeps pointing to
+ *        it until the response is sent
+ *
+ * @param req request to queue
+ */
+static void dispatch(struct request* req)
+{
+    req->nc->flags |= MG_F_IN_FLIGHT;
+    req->nc->user_data = req;
+    enqueue(req);
+}
+
+/**
+ * @brief queue the listing of the pictures
  *
  * @param nc connection at which to send
  * @param hm message received when the action was triggered
  */
 static void handle_list_call(struct mg_connection* nc, struct http_message* hm)
 {
-    char* do_list_res = do_list(nc->user_data, JSON);
-    send_header(nc, "200 OK", "application/json", strlen(do_list_res));
-    mg_printf(nc, "%s", do_list_res);
-    mg_send_http_chunk(nc, "", 0);
-    free(do_list_res);
+    struct request* req = new_request(nc, ACTION_LIST);
+    if(req == NULL) {
+        mg_error(nc, ERR_OUT_OF_MEMORY);
+        return;
+    }
+    dispatch(req);
 }
 
 /**
- * @brief send the content of an image to a client
+ * @brief queue the reading of an image
  *
  * @param connection at which to send
  * @param hm message containing the query string with parameters
@@ -96,7 +256,11 @@ static void handle_list_call(struct mg_connection* nc, struct http_message* hm)
 static void handle_read_call(struct mg_connection* nc, struct http_message* hm)
 {
     char* result[MAX_QUERY_PARAM];
-    char* tmp = calloc((MAX_PIC_ID + 1) * MAX_QUERY_PARAM, sizeof(char));
+    char* tmp = calloc(hm->query_string.len + 1, sizeof(char));
+    if(tmp == NULL) {
+        mg_error(nc, ERR_OUT_OF_MEMORY);
+        return;
+    }
     struct mg_str query = hm->query_string;
 
     // get an array with key value pairs parameters
@@ -121,65 +285,70 @@ static void handle_read_call(struct mg_connection* nc, struct http_message* hm)
         }
     }
 
-    char* img_array = NULL;
-    uint32_t size = 0;
-    // get the db file from the user data linked to the connection
-    struct pictdb_file* db_file = (struct pictdb_file*)nc->user_data;
-
     // if we didn't get all the parameters return
     if(pict_id == NULL || res_code < 0) {
+        free(tmp);
         mg_error(nc, ERR_IO);
         return;
     }
 
-    // read the image from the database
-    int res = do_read(pict_id, res_code, &img_array, &size, db_file);
-    if(res != 0) {
-        mg_error(nc, res);
+    // a truncated id could name another image
+    if(strlen(pict_id) > MAX_PIC_ID) {
+        free(tmp);
+        mg_error(nc, ERR_INVALID_PICID);
         return;
     }
 
-    // send a response if reading was good
-    send_header(nc, "200 OK", "image/jpeg", size);
-    mg_send(nc, img_array, size);
-
-    free(img_array);
+    struct request* req = new_request(nc, ACTION_READ);
+    if(req == NULL) {
+        free(tmp);
+        mg_error(nc, ERR_OUT_OF_MEMORY);
+        return;
+    }
+    strncpy(req->pict_id, pict_id, MAX_PIC_ID);
+    req->res_code = res_code;
     free(tmp);
+    dispatch(req);
 }
 
 /**
- * @brief insert an image received from the client
+ * @brief queue the insertion of an image received from the client
  *
  * @param nc connection which has sent the image
  * @param hm message containing the image content
  */
 static void handle_insert_call(struct mg_connection* nc, struct http_message* hm)
 {
-    char var_name[100], filename[MAX_PIC_ID];
+    // one more character than an id may have: a longer name is truncated
+    // by mongoose, but not to a valid id
+    char var_name[100], filename[MAX_PIC_ID + 2];
     const char *image = NULL;
     size_t image_size = 0;
 
     // get the image content
-    if(mg_parse_multipart(hm->body.p, hm->body.len, var_name, sizeof(var_name), filename, MAX_PIC_ID, &image, &image_size) == 0) {
+    if(mg_parse_multipart(hm->body.p, hm->body.len, var_name, sizeof(var_name), filename, sizeof(filename), &image, &image_size) == 0) {
         return;
     }
-
-    struct pictdb_file* db_file = (struct pictdb_file*)nc->user_data;
-
-    // try to insert, if fail forward the error to mg_error
-    int res = do_insert(image, image_size, filename, db_file);
-    if(res != 0) {
-        mg_error(nc, res);
+    if(strlen(filename) > MAX_PIC_ID) {
+        mg_error(nc, ERR_INVALID_PICID);
         return;
     }
 
-    // if insert works, send response to client and redirect him
-    mg_printf(nc, "HTTP/1.1 302 Found\r\nLocation: http://localhost:%s/index.html\r\n\r\n", s_http_port);
-    mg_send_http_chunk(nc, "", 0);
+    // the message is gone once the handler returns: keep a copy
+    struct request* req = new_request(nc, ACTION_INSERT);
+    if(req == NULL || (req->image = malloc(image_size > 0 ? image_size : 1)) == NULL) {
+        free_request(req);
+        mg_error(nc, ERR_OUT_OF_MEMORY);
+        return;
+    }
+    memcpy(req->image, image, image_size);
+    req->image_size = image_size;
+    strncpy(req->pict_id, filename, MAX_PIC_ID);
+    dispatch(req);
 }
 
 /**
- * @brief delete an image chosen by a client
+ * @brief queue the deletion of an image chosen by a client
  *
  * @param nc connection which has initiate the delete request
  * @param hm message containing the query param
@@ -187,7 +356,11 @@ static void handle_insert_call(struct mg_connection* nc, struct http_message* hm
 static void handle_delete_call(struct mg_connection* nc, struct http_message* hm)
 {
     char* result[MAX_QUERY_PARAM];
-    char* tmp = calloc((MAX_PIC_ID + 1) * MAX_QUERY_PARAM, sizeof(char));
+    char* tmp = calloc(hm->query_string.len + 1, sizeof(char));
+    if(tmp == NULL) {
+        mg_error(nc, ERR_OUT_OF_MEMORY);
+        return;
+    }
     struct mg_str query = hm->query_string;
 
     // fill the result tab
@@ -202,27 +375,405 @@ static void handle_delete_call(struct mg_connection* nc, struct http_message* hm
 
     // we couldn't find a parameter with key pict_id
     if(result[counter] == NULL) {
+        free(tmp);
         mg_error(nc, ERR_IO);
         return;
     }
 
     pict_id = result[counter+1];
 
-    if(pict_id == NULL) {
+    // a truncated id could name another image
+    if(pict_id == NULL || strlen(pict_id) > MAX_PIC_ID) {
+        free(tmp);
         mg_error(nc, ERR_INVALID_PICID);
         return;
     }
 
-    struct pictdb_file* db_file = (struct pictdb_file*)nc->user_data;
-    int res = do_delete(pict_id, db_file);
-    if(res != 0) {
-        mg_error(nc, res);
+    struct request* req = new_request(nc, ACTION_DELETE);
+    if(req == NULL) {
+        free(tmp);
+        mg_error(nc, ERR_OUT_OF_MEMORY);
         return;
     }
-
-    mg_printf(nc, "HTTP/1.1 302 Found\r\nLocation: http://localhost:%s/index.html\r\n\r\n", s_http_port);
-    mg_send_http_chunk(nc, "", 0);
+    strncpy(req->pict_id, pict_id, MAX_PIC_ID);
     free(tmp);
+    dispatch(req);
+}
+
+/**
+ * @brief read an image for a request, or hand the request to the resize
+ *        pool if its resized image is missing
+ *
+ * @param req read request
+ *
+ * @return 1 if the resize pool took the request, 0 if it was run
+ */
+static int read_request(struct request* req)
+{
+    struct pictdb_file* db_file = req->db_file;
+
+    // a read the resize pool already ran for resizes inline if its image
+    // was dropped again meanwhile, rather than going round once more
+    if(req->res_code != RES_ORIG && !req->resized && db_lock_read(db_file) == 0) {
+        int i = index_find_id(db_file, req->pict_id);
+        if(i >= 0 && (db_file->metadata[i].offset[req->res_code] == 0
+                      || db_file->metadata[i].size[req->res_code] == 0)) {
+            // the other resolution costs little more once the original is
+            // decoded: generate both
+            const int wanted[NB_RES] = { 1, 1, 0 };
+            if(resize_pool_submit_waiting(&s_resize_pool, i, wanted, resize_finished, req) == 0) {
+                // the request belongs to the pool now
+                db_unlock(db_file);
+                return 1;
+            }
+        }
+        db_unlock(db_file);
+    }
+
+    uint32_t size = 0;
+    req->result = do_read(req->pict_id, req->res_code, &req->image, &size, db_file);
+    req->image_size = size;
+    return 0;
+}
+
+/**
+ * @brief run the database action of a request
+ *
+ * @param req request to run
+ *
+ * @return 1 if the request was handed to the resize pool, 0 if it was run
+ */
+static int run_request(struct request* req)
+{
+    struct pictdb_file* db_file = req->db_file;
+
+    switch(req->action) {
+    case ACTION_LIST:
+        req->list = do_list(db_file, JSON);
+        if(req->list == NULL) {
+            req->result = ERR_OUT_OF_MEMORY;
+        }
+        break;
+    case ACTION_READ:
+        return read_request(req);
+    case ACTION_INSERT:
+        // try to insert, if fail forward the error to mg_error
+        req->result = do_insert(req->image, req->image_size, req->pict_id, db_file);
+        // the first read of the image should not wait for vips
+        if(req->result == 0 && s_eager && db_lock_read(db_file) == 0) {
+            const int wanted[NB_RES] = { 1, 1, 0 };
+            int slot = index_find_id(db_file, req->pict_id);
+            if(slot >= 0 && resize_pool_submit(&s_resize_pool, slot, wanted) != 0) {
+                fprintf(stderr, "%s: resized images left to the first read\n", req->pict_id);
+            }
+            db_unlock(db_file);
+        }
+        break;
+    case ACTION_DELETE:
+        req->result = do_delete(req->pict_id, db_file);
+        if(req->result == 0) {
+            // the image may have left enough dead bytes behind
+            if(db_lock_read(db_file) == 0) {
+                int needed = compact_needed(db_file);
+                db_unlock(db_file);
+                if(needed) {
+                    want_compaction();
+                }
+            }
+        }
+        break;
+    }
+    return 0;
+}
+
+/**
+ * @brief run the queued requests and post them back to the loop, until
+ *        the server stops
+ */
+static void* request_worker(void* arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&s_queue_lock);
+    for(;;) {
+        while(!s_stopping && s_queue == NULL) {
+            pthread_cond_wait(&s_queue_cond, &s_queue_lock);
+        }
+        if(s_stopping) {
+            break;
+        }
+        struct request* req = s_queue;
+        s_queue = req->next;
+        if(s_queue == NULL) {
+            s_queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&s_queue_lock);
+
+        // the loop owns the request again and frees it
+        if(!run_request(req)) {
+            mg_broadcast(s_mgr, deliver_response, &req, sizeof(req));
+        }
+
+        pthread_mutex_lock(&s_queue_lock);
+    }
+    s_running_workers--;
+    pthread_mutex_unlock(&s_queue_lock);
+
+    // release the buffers vips keeps for each thread
+    vips_thread_shutdown();
+    return NULL;
+}
+
+/**
+ * @brief answer a request with the result of its action
+ *
+ * @param nc connection which sent the request
+ * @param req request run by a worker
+ */
+static void send_response(struct mg_connection* nc, struct request* req)
+{
+    if(req->result != 0) {
+        mg_error(nc, req->result);
+        return;
+    }
+
+    switch(req->action) {
+    case ACTION_LIST:
+        send_header(nc, "200 OK", "application/json", strlen(req->list));
+        mg_printf(nc, "%s", req->list);
+        mg_send_http_chunk(nc, "", 0);
+        break;
+    case ACTION_READ:
+        // send a response if reading was good
+        send_header(nc, "200 OK", "image/jpeg", req->image_size);
+        mg_send(nc, req->image, req->image_size);
+        break;
+    case ACTION_INSERT:
+    case ACTION_DELETE:
+        // if it works, send response to client and redirect him
+        mg_printf(nc, "HTTP/1.1 302 Found\r\nLocation: http://localhost:%s/index.html\r\n\r\n", s_http_port);
+        mg_send_http_chunk(nc, "", 0);
+        break;
+    }
+}
+
+/**
+ * @brief find the connection waiting for a request
+ *
+ * @param mgr manager of the connections
+ * @param req request of the connection
+ *
+ * @return the connection, NULL if it was closed meanwhile
+ */
+static struct mg_connection* find_connection(struct mg_mgr* mgr, struct request* req)
+{
+    struct mg_connection* c = NULL;
+    for(c = mg_next(mgr, NULL); c != NULL; c = mg_next(mgr, c)) {
+        if(c == req->nc && (c->flags & MG_F_IN_FLIGHT) && c->user_data == req) {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief send the response of a request on its connection, which may take
+ *        the next one
+ *
+ * @param nc connection waiting for the request
+ * @param req request to answer
+ */
+static void answer(struct mg_connection* nc, struct request* req)
+{
+    nc->flags &= ~MG_F_IN_FLIGHT;
+    nc->user_data = req->db_file;
+    send_response(nc, req);
+    if(nc->flags & MG_F_CLOSE_AFTER) {
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+    }
+}
+
+/**
+ * @brief send the response of a request posted by a worker
+ *
+ * mg_broadcast calls this for every connection: the work is done once,
+ * for the listening connection. The connection of the request may have
+ * been closed meanwhile, the request is freed anyway.
+ */
+static void deliver_response(struct mg_connection* nc, int ev, void* p)
+{
+    (void) ev;
+    if(nc != s_listener) {
+        return;
+    }
+
+    struct request* req = *(struct request**) p;
+    struct mg_connection* c = find_connection(nc->mgr, req);
+    if(c != NULL) {
+        answer(c, req);
+    }
+    free_request(req);
+}
+
+/**
+ * @brief queue again a read once the resize pool has written its image,
+ *        called by the loop when it drains the pool
+ *
+ * @param waiter read request handed to the pool
+ * @param result 0 or error code of the resizing
+ */
+static void resize_finished(void* waiter, int result)
+{
+    struct request* req = waiter;
+    req->resized = 1;
+
+    struct mg_connection* c = find_connection(s_mgr, req);
+    if(c == NULL) {
+        free_request(req);
+        return;
+    }
+
+    // no worker takes requests anymore on exit
+    if(result != 0 || s_stopping) {
+        req->result = result != 0 ? result : ERR_IO;
+        answer(c, req);
+        free_request(req);
+        return;
+    }
+    enqueue(req);
+}
+
+/**
+ * @brief start the request workers
+ *
+ * @param nb_workers number of workers
+ */
+static int start_workers(unsigned int nb_workers)
+{
+    while(s_nb_workers < nb_workers
+          && pthread_create(&s_workers[s_nb_workers], NULL, request_worker, NULL) == 0) {
+        s_nb_workers++;
+    }
+    s_running_workers = s_nb_workers;
+    return s_nb_workers > 0 ? 0 : ERR_OUT_OF_MEMORY;
+}
+
+/**
+ * @brief stop the request workers, the requests not run yet are dropped
+ *
+ * A worker posting a response waits for the loop to receive it: the loop
+ * is polled until every worker is done.
+ *
+ * @param mgr loop the responses are posted to
+ */
+static void stop_workers(struct mg_mgr* mgr)
+{
+    pthread_mutex_lock(&s_queue_lock);
+    s_stopping = 1;
+    pthread_cond_broadcast(&s_queue_cond);
+    unsigned int running = s_running_workers;
+    pthread_mutex_unlock(&s_queue_lock);
+
+    while(running > 0) {
+        mg_mgr_poll(mgr, EXIT_POLL_MS);
+        pthread_mutex_lock(&s_queue_lock);
+        running = s_running_workers;
+        pthread_mutex_unlock(&s_queue_lock);
+    }
+
+    unsigned int t = 0;
+    for(t = 0; t < s_nb_workers; t++) {
+        pthread_join(s_workers[t], NULL);
+    }
+    s_nb_workers = 0;
+
+    while(s_queue != NULL) {
+        struct request* next = s_queue->next;
+        free_request(s_queue);
+        s_queue = next;
+    }
+    s_queue_tail = NULL;
+}
+
+/**
+ * @brief wake the compaction thread up
+ */
+static void want_compaction(void)
+{
+    pthread_mutex_lock(&s_compact_lock);
+    s_compact_wanted = 1;
+    pthread_cond_signal(&s_compact_cond);
+    pthread_mutex_unlock(&s_compact_lock);
+}
+
+/**
+ * @brief tell whether the server stops
+ */
+static int compaction_stopping(void)
+{
+    pthread_mutex_lock(&s_compact_lock);
+    int stopping = s_compact_stopping;
+    pthread_mutex_unlock(&s_compact_lock);
+    return stopping;
+}
+
+/**
+ * @brief compact the database while the requests are served
+ *
+ * The extents are copied without the lock of the database and a slice of
+ * COMPACT_SLICE_EXTENTS extents is repointed at once under the write lock,
+ * so the reads only wait for the metadata to be updated.
+ *
+ * @param db_file database to compact
+ */
+static void compact_online(struct pictdb_file* db_file)
+{
+    struct compaction compaction;
+    db_lock_write(db_file);
+    int res = compact_begin(db_file, &compaction, 1);
+    db_unlock(db_file);
+
+    while(res == 0 && !compact_done(&compaction) && !compaction_stopping()) {
+        res = compact_step(db_file, &compaction, COMPACT_SLICE_EXTENTS);
+    }
+    if(res == 0 && compact_done(&compaction)) {
+        db_lock_write(db_file);
+        res = compact_end(db_file, &compaction);
+        db_unlock(db_file);
+    } else {
+        // an unfinished compaction leaves a valid database
+        compact_abort(&compaction);
+    }
+    if(res != 0) {
+        fprintf(stderr, "compaction stopped: %s\n", ERROR_MESSAGES[res]);
+    }
+}
+
+/**
+ * @brief compact the database each time a delete leaves enough dead bytes,
+ *        until the server stops
+ */
+static void* compactor(void* arg)
+{
+    struct pictdb_file* db_file = arg;
+
+    pthread_mutex_lock(&s_compact_lock);
+    for(;;) {
+        while(!s_compact_stopping && !s_compact_wanted) {
+            pthread_cond_wait(&s_compact_cond, &s_compact_lock);
+        }
+        if(s_compact_stopping) {
+            break;
+        }
+        s_compact_wanted = 0;
+        pthread_mutex_unlock(&s_compact_lock);
+
+        compact_online(db_file);
+
+        pthread_mutex_lock(&s_compact_lock);
+    }
+    pthread_mutex_unlock(&s_compact_lock);
+    return NULL;
 }
 
 /**
@@ -239,6 +790,11 @@ static void ev_handler(struct mg_connection *nc, int ev, void *p)
 
     switch(ev) {
     case MG_EV_HTTP_REQUEST:
+        // one request at a time per connection, the responses stay in order
+        if(nc->flags & MG_F_IN_FLIGHT) {
+            nc->flags |= MG_F_CLOSE_AFTER;
+            return;
+        }
         if(mg_vcmp(&hm->uri, "/pictDB/list") == 0) {
             handle_list_call(nc, hm);
         } else if(mg_vcmp(&hm->uri, "/pictDB/read") == 0) {
@@ -287,7 +843,7 @@ int main (int argc, char* argv[])
 {
 
     // check for the right number of arguments
-    if(argc != 2) {
+    if(argc < 2) {
         return ERR_INVALID_ARGUMENT;
     }
 
@@ -295,17 +851,59 @@ int main (int argc, char* argv[])
         return ERR_INVALID_FILENAME;
     }
 
+    // -resizers <N>: N threads generate the missing resized images, 1 by
+    // default
+    // -eager <N>: as -resizers, and the images are resized after each insert
+    // -workers <N>: N threads handle the requests, one per core by default
+    unsigned int resize_threads = 1;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int nb_workers = cores < 1 ? 1 : (cores > MAX_THREADS ? MAX_THREADS : (unsigned int) cores);
+    int i = 2;
+    while(i < argc) {
+        if(i + 1 >= argc) {
+            return ERR_NOT_ENOUGH_ARGUMENTS;
+        }
+        unsigned int n = atouint32(argv[i+1]);
+        if(n == 0 || n > MAX_THREADS) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        if(strcmp(argv[i], "-resizers") == 0) {
+            resize_threads = n;
+        } else if(strcmp(argv[i], "-eager") == 0) {
+            resize_threads = n;
+            s_eager = 1;
+        } else if(strcmp(argv[i], "-workers") == 0) {
+            nb_workers = n;
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+        i += 2;
+    }
+
     if (VIPS_INIT(argv[0])) {
         vips_error_exit("unable to start VIPS");
     }
 
     struct pictdb_file db_file;
     // open the db_file
-    if(do_open(argv[1], "rb+", &db_file) != 0) {
+    if(do_open(argv[1], "rb+m", &db_file) != 0) {
         return ERR_IO;
     }
 
+    // the workers share the indexes: build them before any of them starts
+    if(db_lock_read(&db_file) != 0) {
+        do_close(&db_file);
+        return ERR_OUT_OF_MEMORY;
+    }
+    db_unlock(&db_file);
+
     print_header(&(db_file.header));
+    s_compact_wanted = compact_needed(&db_file);
+
+    if(resize_pool_start(&s_resize_pool, &db_file, resize_threads) != 0) {
+        do_close(&db_file);
+        return ERR_OUT_OF_MEMORY;
+    }
 
     // assign a signal handler to SIGTERM and SIGINT to handle the server termination
     signal(SIGTERM, signal_handler);
@@ -315,26 +913,48 @@ int main (int argc, char* argv[])
     struct mg_connection *nc;
 
     mg_mgr_init(&mgr, NULL);
-    if((nc = mg_bind(&mgr, s_http_port, ev_handler)) == NULL) {
+    if((nc = mg_bind(&mgr, s_http_port, ev_handler)) == NULL || start_workers(nb_workers) != 0
+       || pthread_create(&s_compactor, NULL, compactor, &db_file) != 0) {
+        stop_workers(&mgr);
+        resize_pool_stop(&s_resize_pool);
+        mg_mgr_free(&mgr);
         do_close(&db_file);
         return ERR_IO;
     }
     nc->user_data = &db_file;
+    s_mgr = &mgr;
+    s_listener = nc;
 
     // Set up HTTP server parameters
     mg_set_protocol_http_websocket(nc);
     s_http_server_opts.document_root = ".";
     s_http_server_opts.enable_directory_listing = "yes";
 
-    printf("Server started on port %s\n", s_http_port);
+    printf("Server started on port %s with %u workers\n", s_http_port, s_nb_workers);
 
-    // listen while we didn't receive a termination signal
+    // listen while we didn't receive a termination signal, and write the
+    // resized images the workers have finished, which lets the reads
+    // waiting for them go on: only when no request holds the database, the
+    // loop never waits for the workers
     while(!s_sig_received) {
-        mg_mgr_poll(&mgr, 1000);
+        int generating = resize_pool_pending(&s_resize_pool) > 0;
+        mg_mgr_poll(&mgr, generating ? RESIZE_POLL_MS : 1000);
+        if(generating && resize_pool_drain(&s_resize_pool, 0) != 0) {
+            fprintf(stderr, "resized images couldn't be written: left to their first read\n");
+        }
     }
 
     printf("\nExiting on signal %d\n", s_sig_received);
 
+    // the reads still waiting for the resize pool are answered with an
+    // error
+    stop_workers(&mgr);
+    resize_pool_stop(&s_resize_pool);
+    pthread_mutex_lock(&s_compact_lock);
+    s_compact_stopping = 1;
+    pthread_cond_signal(&s_compact_cond);
+    pthread_mutex_unlock(&s_compact_lock);
+    pthread_join(s_compactor, NULL);
     do_close(&db_file);
     mg_mgr_free(&mgr);
     vips_shutdown();
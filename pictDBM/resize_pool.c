@@ -0,0 +1,302 @@
+/**
+ * @file resize_pool.c
+ * @brief pictDB library: pool of threads generating resized images
+ *
+ * Submitted jobs wait in a queue until a worker claims them. A worker runs
+ * the job without holding any lock, not even the one of the database: the
+ * original it reads may be moved meanwhile, which resize_job_commit notices.
+ * The finished jobs are then committed by resize_pool_drain, under the
+ * write lock of the database, and their waiters told once it is released.
+ *
+ * @author Basile Thullen, Jeremy Hottinger
+ * @date 13 Jun 2016
+ */
+
+#include "resize_pool.h"
+
+static void* resize_worker(void* arg);
+static size_t drop_tasks(struct resize_task* task);
+static void finish_task(struct resize_task* task, int result);
+
+/**
+ * @brief run the submitted jobs until the pool stops
+ */
+static void* resize_worker(void* arg)
+{
+    struct resize_pool* pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for(;;) {
+        while(!pool->stopping && pool->todo == NULL) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if(pool->stopping) {
+            break;
+        }
+        struct resize_task* task = pool->todo;
+        pool->todo = task->next;
+        if(pool->todo == NULL) {
+            pool->todo_tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        task->result = resize_job_run(&task->job, pool->db_file);
+        task->next = NULL;
+
+        pthread_mutex_lock(&pool->lock);
+        if(pool->done_tail != NULL) {
+            pool->done_tail->next = task;
+        } else {
+            pool->done = task;
+        }
+        pool->done_tail = task;
+        pthread_cond_broadcast(&pool->finished);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    // release the buffers vips keeps for each thread
+    vips_thread_shutdown();
+    return NULL;
+}
+
+/**
+ * @brief tell the waiter of a task how its job ended, and free it
+ */
+static void finish_task(struct resize_task* task, int result)
+{
+    if(task->done != NULL) {
+        task->done(task->waiter, result);
+    }
+    resize_job_free(&task->job);
+    free(task);
+}
+
+/**
+ * @brief give up a list of tasks, return how many there were
+ */
+static size_t drop_tasks(struct resize_task* task)
+{
+    size_t count = 0;
+    while(task != NULL) {
+        struct resize_task* next = task->next;
+        finish_task(task, ERR_IO);
+        task = next;
+        count++;
+    }
+    return count;
+}
+
+/**
+ * @brief start the threads of a pool
+ *
+ * @param pool pool to initialize
+ * @param db_file database the jobs read and are committed to
+ * @param nb_threads number of worker threads
+ */
+int resize_pool_start(struct resize_pool* pool, struct pictdb_file* db_file, unsigned int nb_threads)
+{
+    if(pool == NULL || db_file == NULL || nb_threads == 0 || nb_threads > MAX_THREADS) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    memset(pool, 0, sizeof(struct resize_pool));
+    pool->db_file = db_file;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+
+    while(pool->nb_threads < nb_threads
+          && pthread_create(&pool->threads[pool->nb_threads], NULL, resize_worker, pool) == 0) {
+        pool->nb_threads++;
+    }
+    if(pool->nb_threads == 0) {
+        // out of threads or of memory for their stacks
+        pthread_cond_destroy(&pool->finished);
+        pthread_cond_destroy(&pool->work);
+        pthread_mutex_destroy(&pool->lock);
+        return ERR_OUT_OF_MEMORY;
+    }
+    return 0;
+}
+
+/**
+ * @brief queue the generation of the missing resized images of an image
+ *
+ * @param pool pool running the job
+ * @param image_id index of the image in the database
+ * @param wanted non zero for each resolution to generate
+ */
+int resize_pool_submit(struct resize_pool* pool, size_t image_id, const int wanted[NB_RES])
+{
+    return resize_pool_submit_waiting(pool, image_id, wanted, NULL, NULL);
+}
+
+/**
+ * @brief queue the generation of the missing resized images of an image,
+ *        and be told by resize_pool_drain once they are written
+ *
+ * @param pool pool running the job
+ * @param image_id index of the image in the database
+ * @param wanted non zero for each resolution to generate
+ * @param done called once the job is committed or given up
+ * @param waiter given back to done
+ */
+int resize_pool_submit_waiting(struct resize_pool* pool, size_t image_id, const int wanted[NB_RES],
+                               resize_done done, void* waiter)
+{
+    if(pool == NULL || wanted == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct resize_task* task = calloc(1, sizeof(struct resize_task));
+    if(task == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // the snapshot is taken under the lock the caller holds
+    int res = resize_job_init(&task->job, pool->db_file, image_id, wanted);
+    if(res != 0 || task->job.nb_missing == 0) {
+        free(task);
+        return res;
+    }
+    task->done = done;
+    task->waiter = waiter;
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->todo_tail != NULL) {
+        pool->todo_tail->next = task;
+    } else {
+        pool->todo = task;
+    }
+    pool->todo_tail = task;
+    pool->pending++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/**
+ * @brief commit the jobs the workers have run, report the images that
+ *        couldn't be resized
+ *
+ * @param pool pool running the jobs
+ * @param wait non zero to wait until every submitted job is committed
+ */
+int resize_pool_drain(struct resize_pool* pool, int wait)
+{
+    if(pool == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    int first_error = 0;
+    for(;;) {
+        pthread_mutex_lock(&pool->lock);
+        while(wait && pool->done == NULL && pool->pending > 0) {
+            pthread_cond_wait(&pool->finished, &pool->lock);
+        }
+        struct resize_task* task = pool->done;
+        pool->done = NULL;
+        pool->done_tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        if(task == NULL) {
+            return first_error;
+        }
+
+        if(wait) {
+            db_lock_write(pool->db_file);
+        } else if(db_trylock_write(pool->db_file) != 0) {
+            // the database is busy: the jobs wait for the next drain
+            pthread_mutex_lock(&pool->lock);
+            struct resize_task* last = task;
+            while(last->next != NULL) {
+                last = last->next;
+            }
+            last->next = pool->done;
+            if(pool->done == NULL) {
+                pool->done_tail = last;
+            }
+            pool->done = task;
+            pthread_mutex_unlock(&pool->lock);
+            return first_error;
+        }
+
+        // the workers keep running while the finished jobs are written
+        struct resize_task* t = NULL;
+        for(t = task; t != NULL; t = t->next) {
+            if(t->result != 0) {
+                // the image stays resized lazily by its first read
+                fprintf(stderr, "%s: %s\n", t->job.metadata.pict_id, ERROR_MESSAGES[t->result]);
+            } else {
+                t->result = resize_job_commit(&t->job, pool->db_file);
+                if(t->result != 0 && first_error == 0) {
+                    first_error = t->result;
+                }
+            }
+        }
+        db_unlock(pool->db_file);
+
+        // the waiters may use the database again
+        size_t committed = 0;
+        while(task != NULL) {
+            struct resize_task* next = task->next;
+            finish_task(task, task->result);
+            committed++;
+            task = next;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->pending -= committed;
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/**
+ * @brief number of jobs submitted and not committed yet
+ *
+ * @param pool pool running the jobs
+ */
+size_t resize_pool_pending(struct resize_pool* pool)
+{
+    if(pool == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&pool->lock);
+    size_t pending = pool->pending;
+    pthread_mutex_unlock(&pool->lock);
+    return pending;
+}
+
+/**
+ * @brief stop the threads of a pool
+ *
+ * @param pool pool to stop
+ */
+void resize_pool_stop(struct resize_pool* pool)
+{
+    if(pool == NULL || pool->nb_threads == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    unsigned int t = 0;
+    for(t = 0; t < pool->nb_threads; t++) {
+        pthread_join(pool->threads[t], NULL);
+    }
+    pool->nb_threads = 0;
+
+    // the workers are gone: what they ran is kept, the rest is dropped
+    pool->pending -= drop_tasks(pool->todo);
+    pool->todo = NULL;
+    pool->todo_tail = NULL;
+    resize_pool_drain(pool, 1);
+    pool->pending = 0;
+
+    pthread_cond_destroy(&pool->finished);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+}
@@ -0,0 +1,121 @@
+/**
+ * @file resize_pool.h
+ * @brief prototypes for the pool of threads generating resized images
+ *
+ * Worker threads decode the originals and encode their missing resolutions.
+ * They only read the database, without its lock: the finished jobs are
+ * committed by resize_pool_drain under the write lock.
+ *
+ * @author Basile Thullen, Jeremy Hottinger
+ * @date 13 Jun 2016
+ */
+
+#ifndef RESIZE_POOL_H
+#define RESIZE_POOL_H
+
+#include <pthread.h>
+#include "pictDB.h"
+#include "image_content.h"
+
+/* Called once the job of a waiter is committed, or given up, with 0 or the
+ * error that stopped it */
+typedef void (*resize_done)(void* waiter, int result);
+
+/* A job waiting in one of the queues of a pool */
+struct resize_task {
+    struct resize_job job;
+    int result;                 // result of resize_job_run
+    resize_done done;           // NULL if no one waits for the job
+    void* waiter;
+    struct resize_task* next;
+};
+
+/* Pool of threads running resize jobs */
+struct resize_pool {
+    struct pictdb_file* db_file;
+    pthread_t threads[MAX_THREADS];
+    unsigned int nb_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work;        // a job was submitted, or the pool stops
+    pthread_cond_t finished;    // a job was run
+    struct resize_task* todo;   // jobs to run, in submission order
+    struct resize_task* todo_tail;
+    struct resize_task* done;   // jobs to commit
+    struct resize_task* done_tail;
+    size_t pending;             // jobs submitted and not committed yet
+    int stopping;
+};
+
+/**
+ * @brief start the threads of a pool
+ *
+ * @param pool pool to initialize
+ * @param db_file database the jobs read and are committed to
+ * @param nb_threads number of worker threads, at most MAX_THREADS
+ *
+ * @return 0 if successful, error code if not
+ */
+int resize_pool_start(struct resize_pool* pool, struct pictdb_file* db_file, unsigned int nb_threads);
+
+/**
+ * @brief queue the generation of the missing resized images of an image,
+ *        nothing is queued if none is missing, the caller holds the lock of
+ *        the database
+ *
+ * @param pool pool running the job
+ * @param image_id index of the image in the database
+ * @param wanted non zero for each resolution to generate
+ *
+ * @return 0 if successful, error code if not
+ */
+int resize_pool_submit(struct resize_pool* pool, size_t image_id, const int wanted[NB_RES]);
+
+/**
+ * @brief queue the generation of the missing resized images of an image,
+ *        and be told by resize_pool_drain once they are written
+ *
+ * Nothing is queued, and done is never called, if no wanted resolution is
+ * missing. The caller holds the lock of the database.
+ *
+ * @param pool pool running the job
+ * @param image_id index of the image in the database
+ * @param wanted non zero for each resolution to generate
+ * @param done called by the thread draining the pool, without the lock of
+ *        the database
+ * @param waiter given back to done
+ *
+ * @return 0 if successful, error code if not
+ */
+int resize_pool_submit_waiting(struct resize_pool* pool, size_t image_id, const int wanted[NB_RES],
+                               resize_done done, void* waiter);
+
+/**
+ * @brief commit the jobs the workers have run under the write lock of the
+ *        database, the images that couldn't be resized are reported and
+ *        skipped, the caller must not hold the lock
+ *
+ * @param pool pool running the jobs
+ * @param wait non zero to wait until every submitted job is committed, zero
+ *        to return at once if the database is busy
+ *
+ * @return 0 if successful, the first error writing a job otherwise
+ */
+int resize_pool_drain(struct resize_pool* pool, int wait);
+
+/**
+ * @brief number of jobs submitted and not committed yet
+ *
+ * @param pool pool running the jobs
+ */
+size_t resize_pool_pending(struct resize_pool* pool);
+
+/**
+ * @brief stop the threads of a pool, the jobs not run yet are dropped, their
+ *        waiters told so with ERR_IO, and the ones already run are
+ *        committed, the caller must not hold the lock of the database
+ *
+ * @param pool pool to stop
+ */
+void resize_pool_stop(struct resize_pool* pool);
+
+#endif